@@ -9,23 +9,28 @@ namespace iot
     typedef std::string String;
     typedef std::vector<String> StringVector;
 
+    class IoOwner;
+
     class Identity
     {
     public:
         Identity();
         Identity(const String& mpinIdHex, const String& clientSecretHex);
         void SetSokKeys(const String& sendKeyHex, const String& recvKeyHex);
+        void SetPrecomputeData(const String& precomputeDataHex);
         String GetUserId() const;
         String GetMPinIdHex() const;
         String GetClientSecretHex() const;
         String GetSokSendKeyHex() const;
         String GetSokRecvKeyHex() const;
+        String GetPrecomputeDataHex() const;
 
         String mpinId;
         String clientSecret;
         StringVector dtaList;
         String sokSendKey;
         String sokRecvKey;
+        String precomputeData;
     };
 
     class EventListener
@@ -39,6 +44,14 @@ namespace iot
         virtual void OnError(const String& error) = 0;
         virtual void OnMessageArrived(const String& topic, const String& payload) = 0;
         virtual void OnPrivateMessageArrived(const String& userIdFrom, const String& payload) = 0;
+        virtual void OnPublishCompleted(unsigned short packetId, bool ok) {}
+    };
+
+    class MessageHandler
+    {
+    public:
+        virtual ~MessageHandler() {}
+        virtual void OnMessageArrived(const String& topic, const String& payload) = 0;
     };
 
     class Config
@@ -54,15 +67,70 @@ namespace iot
         unsigned long mqttCommandTimeoutMillisec;
         bool useMqttQoS2;
         bool useMqttPersistentSession;
+        unsigned int mqttPublishWindow;
+        unsigned long reconnectMinDelayMillisec;
+        unsigned long reconnectMaxDelayMillisec;
+        unsigned int mqttMaxIncomingPacketSize;
+        unsigned int mqttMaxTopicsPerSubscribe;
+        String outboundQueueFile;
+        unsigned long outboundQueueMaxSize;
+        bool outboundQueueDropOldest;
+        bool useIoThread;
+        unsigned int ioThreadQueueSize;
+        unsigned int sokKeyCacheSize;
+        unsigned int authPass1PoolSize;
+        unsigned long pskLifetimeSec;
+        bool useTlsSessionResumption;
+        unsigned int tlsMaxFragmentLength;
         Identity identity;
 
     private:
         EventListener *m_eventListener;
     };
 
+    class Statistics
+    {
+    public:
+        Statistics();
+
+        unsigned long sokKeyCacheHits;
+        unsigned long sokKeyCacheMisses;
+        unsigned long pskCacheHits;
+        unsigned long pskCacheMisses;
+        unsigned long pskCacheRejects;
+        unsigned long authPass1PoolHits;
+        unsigned long authPass1PoolMisses;
+        unsigned long tlsHandshakes;
+        unsigned long tlsResumedHandshakes;
+        unsigned long tlsReads;
+        unsigned long tlsWrites;
+        unsigned long tlsBufferBytes;
+        unsigned long messagesReceived;
+        unsigned long incomingQoS2Pending;
+        unsigned long incomingQoS2PendingMax;
+        unsigned long outboundQueueLength;
+        unsigned long outboundQueueDropped;
+        unsigned long ioQueueLength;
+        unsigned long ioQueueMaxLength;
+        unsigned long ioQueueRejected;
+        unsigned long ioQueueLatencyAvgMicrosec;
+        unsigned long ioQueueLatencyMaxMicrosec;
+        unsigned long connectAuthMicrosec;
+        unsigned long connectSocketMicrosec;
+        unsigned long connectTlsHandshakeMicrosec;
+        unsigned long connectMqttMicrosec;
+        unsigned long connectTotalMicrosec;
+    };
+
     class Client
     {
     public:
+        enum IOEvent
+        {
+            IO_READ = 1,
+            IO_WRITE = 2
+        };
+
         Client();
         ~Client();
         void Configure(const Config& conf);
@@ -72,13 +140,27 @@ namespace iot
         bool IsSessionStarted() const;
         bool IsConnected();
         bool Subscribe(const String& topic);
+        bool Subscribe(const StringVector& topics);
+        bool Subscribe(const String& topic, MessageHandler& handler);
         bool Unsubscribe(const String& topic);
         bool Publish(const String& topic, const String& payload);
+        bool Publish(const String& topic, const String& payload, unsigned short& packetId);
         bool ListenForPrivateMessages();
         bool SendPrivateMessage(const String& userIdTo, const String& payload, bool encrypt = true);
         bool RunMessageLoop(unsigned long timeout);
+        int GetSocket();
+        unsigned int GetIOEvents();
+        long GetIOTimeout();
+        bool ProcessIO();
+        Statistics GetStatistics() const;
 
     private:
+        friend class SessionManager;
+
+        void SetIoOwner(IoOwner *owner);
+        void ProcessCommands();
+        bool HasCommands() const;
+
         class Impl;
         Impl *m_impl;
     };
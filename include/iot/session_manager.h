@@ -0,0 +1,41 @@
+#ifndef _IOT_SESSION_MANAGER_H_
+#define _IOT_SESSION_MANAGER_H_
+
+#include <iot/client.h>
+
+namespace iot
+{
+    class SessionManagerConfig
+    {
+    public:
+        SessionManagerConfig();
+
+        unsigned int workerThreads;
+        unsigned int cryptoThreads;
+        bool pinWorkerThreads;
+        unsigned int maxSessions;
+    };
+
+    class SessionManager
+    {
+    public:
+        SessionManager();
+        ~SessionManager();
+        bool Start(const SessionManagerConfig& conf);
+        void Stop();
+        bool IsStarted() const;
+        bool AddSession(Client& client);
+        bool RemoveSession(Client& client);
+        unsigned int GetSessionCount() const;
+        const String& GetLastError() const;
+
+    private:
+        SessionManager(const SessionManager& other);
+        SessionManager& operator=(const SessionManager& other);
+
+        class Impl;
+        Impl *m_impl;
+    };
+}
+
+#endif // _IOT_SESSION_MANAGER_H_
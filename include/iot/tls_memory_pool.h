@@ -0,0 +1,29 @@
+#ifndef _IOT_TLS_MEMORY_POOL_H_
+#define _IOT_TLS_MEMORY_POOL_H_
+
+namespace iot
+{
+    class TlsMemoryStatistics
+    {
+    public:
+        TlsMemoryStatistics();
+
+        unsigned long capacity;
+        unsigned long reservedBytes;
+        unsigned long usedBytes;
+        unsigned long usedBytesMax;
+        unsigned long requestedBytes;
+        unsigned long allocations;
+        unsigned long failedAllocations;
+    };
+
+    class TlsMemoryPool
+    {
+    public:
+        static bool Enable(unsigned long capacity);
+        static bool IsEnabled();
+        static TlsMemoryStatistics GetStatistics();
+    };
+}
+
+#endif // _IOT_TLS_MEMORY_POOL_H_
@@ -5,6 +5,8 @@
 #include <net/tls_connection.h>
 #include <string>
 #include <map>
+#include <list>
+#include <ctime>
 
 namespace net
 {
@@ -79,6 +81,8 @@ namespace net
             virtual void SetX509CaChain(x509::CaChain& caChain) = 0;
             virtual bool ConnectTo(const Url& url, int timeoutMillisec) = 0;
             virtual void Close() = 0;
+            virtual void Release() = 0;
+            virtual bool IsReused() const = 0;
             virtual int Read(unsigned char* buffer, int len, int timeoutMillisec) = 0;
             virtual int Write(const unsigned char* buffer, int len, int timeoutMillisec) = 0;
             virtual net::Status GetLastError() = 0;
@@ -89,16 +93,18 @@ namespace net
         public:
             Client(Network& network);
             void SetTimeout(int timeoutMillisec);
+            void UseKeepAlive(bool useKeepAlive);
             const Response& Execute(const Request& request);
             net::Status GetLastError();
 
         private:
             bool SendRequest(const Request& request, const std::string& method);
             bool Write(const std::string& data);
-            bool ReadResponse();
+            bool ReadResponse(size_t& received, bool& keepAlive);
 
             Network& m_network;
             int m_timeout;
+            bool m_useKeepAlive;
             Response m_response;
             net::Status m_error;
         };
@@ -107,18 +113,44 @@ namespace net
         {
         public:
             NetworkImpl();
-            virtual ~NetworkImpl() {}
+            virtual ~NetworkImpl();
+            void SetMaxIdleConnections(size_t maxIdleConnections);
+            void SetIdleTimeout(int idleTimeoutSec);
             virtual void SetX509CaChain(x509::CaChain& caChain);
+            void SetTlsContext(TlsContext& context);
             virtual bool ConnectTo(const Url& url, int timeoutMillisec);
             virtual void Close();
+            virtual void Release();
+            virtual bool IsReused() const;
             virtual int Read(unsigned char* buffer, int len, int timeoutMillisec);
             virtual int Write(const unsigned char* buffer, int len, int timeoutMillisec);
             virtual net::Status GetLastError();
 
         private:
-            TcpConnection m_tcpConnection;
-            TlsConnection m_tlsConnection;
+            class IdleConnection
+            {
+            public:
+                IdleConnection(const std::string& _key, Connection *_connection);
+
+                std::string key;
+                Connection *connection;
+                time_t idleSince;
+            };
+
+            typedef std::list<IdleConnection> IdleConnections;
+
+            Connection * TakeIdleConnection(const std::string& key);
+            void DropIdleConnections(size_t maxCount);
+            static bool IsAlive(Connection *connection);
+
+            x509::CaChain *m_caChain;
+            TlsContext *m_tlsContext;
+            IdleConnections m_idleConnections;
+            size_t m_maxIdleConnections;
+            int m_idleTimeout;
             Connection *m_connection;
+            std::string m_connectionKey;
+            bool m_reused;
             net::Status m_error;
         };
     }
@@ -2,10 +2,9 @@
 
 #include <net/common.h>
 #include <net/x509.h>
+#include <net/tls_context.h>
 #include "mbedtls/net_sockets.h"
 #include "mbedtls/ssl.h"
-#include "mbedtls/entropy.h"
-#include "mbedtls/ctr_drbg.h"
 #include <string>
 
 namespace net
@@ -14,29 +13,69 @@ namespace net
     {
     public:
         TlsConnection();
+        explicit TlsConnection(TlsContext& context);
         virtual ~TlsConnection();
         void SetPsk(const std::string& psk, const std::string& pskId);
         void SetX509CaChain(x509::CaChain& caChain);
-        void SetPersonalizationData(const std::string& data);
+        void UseSessionResumption(bool useSessionResumption);
+        void SetMaxFragmentLength(size_t maxFragmentLength);
+        void ClearSession();
+        // Resolves the address and opens the TCP connection ahead of Connect, which then only runs the handshake.
+        // May be called from another thread, while the PSK is being obtained.
+        int OpenSocket();
+        void CloseSocket();
+        bool IsSocketOpen() const;
         virtual int Connect();
         virtual void Close();
         virtual int Read(unsigned char* buffer, int len, int timeoutMillisec);
         virtual int Write(const unsigned char* buffer, int len, int timeoutMillisec);
         std::string GetCiphersuite() const;
+        bool IsHandshakeFailed() const;
+        bool IsSessionResumed() const;
+        unsigned long GetHandshakeCount() const;
+        unsigned long GetResumedHandshakeCount() const;
+        int GetSocket() const;
+        size_t GetBytesAvailable() const;
+        size_t GetMaxRecordSize() const;
+        size_t GetBufferSize() const;
         int Read(unsigned char* buffer, int len);
+        int ReadAvailable(unsigned char* buffer, int len);
         int ReadAll(unsigned char* buffer, int len);
         int ReadAll(unsigned char* buffer, int len, int timeoutMillisec);
         int Write(const unsigned char* buffer, int len);
 
     private:
-        mbedtls_entropy_context m_entropy;
-        mbedtls_ctr_drbg_context m_rng;
+        TlsConnection(const TlsConnection& other);
+        TlsConnection& operator=(const TlsConnection& other);
+
+        void SaveSession();
+        int Handshake(const x509::CaStore *caStore);
+        int VerifyServerCertificate(const x509::CaStore& caStore);
+        bool IsServerCertificateExpected() const;
+        bool IsSavedSessionResumed() const;
+        mbedtls_ssl_config * GetOwnConfig();
+        const mbedtls_ssl_config * GetConfig() const;
+        static int Send(void *ctx, const unsigned char *buf, size_t len);
+        static int Recv(void *ctx, unsigned char *buf, size_t len, uint32_t timeout);
+
+        TlsContext& m_context;
+        mbedtls_ssl_config *m_ownConf;
         mbedtls_ssl_context m_ssl;
-        mbedtls_ssl_config m_conf;
         mbedtls_net_context m_socket;
+        bool m_socketOpen;
+        std::string m_socketAddr;
         std::string m_psk;
         std::string m_pskId;
-        std::string m_persData;
-        bool m_rngSeeded;
+        bool m_handshakeFailed;
+        int m_sendTimeout;
+        int m_readTimeout;
+        unsigned char m_mflCode;
+        mbedtls_ssl_session m_session;
+        std::string m_sessionHost;
+        bool m_sessionSaved;
+        bool m_sessionResumed;
+        bool m_useSessionResumption;
+        unsigned long m_handshakeCount;
+        unsigned long m_resumedHandshakeCount;
     };
 }
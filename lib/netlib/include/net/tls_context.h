@@ -0,0 +1,46 @@
+#pragma once
+
+#include <net/common.h>
+#include <net/x509.h>
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include <string>
+
+namespace net
+{
+    // TLS client state, which may be shared between many connections and threads - the entropy source, the random
+    // generator and the SSL configuration. The configuration must not be changed after connections start to use it.
+    class TlsContext
+    {
+    public:
+        TlsContext();
+        explicit TlsContext(const std::string& personalizationData);
+        ~TlsContext();
+        bool IsInitialized() const;
+        void SetX509CaChain(x509::CaChain& caChain);
+        void SetX509CaStore(const x509::CaStore& caStore);
+        const x509::CaStore * GetX509CaStore() const;
+        const mbedtls_ssl_config * GetConfig() const;
+        void SetupConfig(mbedtls_ssl_config& conf) const;
+        const Status& GetLastError() const;
+        static TlsContext& GetDefault();
+
+    private:
+        TlsContext(const TlsContext& other);
+        TlsContext& operator=(const TlsContext& other);
+
+        void Init(const std::string& personalizationData);
+        static int Random(void *ctx, unsigned char *output, size_t len);
+
+        mbedtls_entropy_context m_entropy;
+        mbedtls_ctr_drbg_context m_rng;
+        mbedtls_ssl_config m_conf;
+        const x509::CaStore *m_caStore;
+#ifdef _WIN32
+        void *m_rngLock;
+#endif
+        bool m_initialized;
+        Status m_lastError;
+    };
+}
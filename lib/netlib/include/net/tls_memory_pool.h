@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+
+namespace net
+{
+    class TlsMemoryStats
+    {
+    public:
+        TlsMemoryStats();
+
+        size_t capacity;
+        size_t reservedBytes;
+        size_t usedBytes;
+        size_t usedBytesMax;
+        size_t requestedBytes;
+        unsigned long allocations;
+        unsigned long failedAllocations;
+    };
+
+    // Process-wide allocator for mbedtls. The memory is taken from the system once, as a single arena, and is split
+    // in blocks of a fixed set of sizes. Freed blocks are kept for the next allocation of the same size class and are
+    // never returned to the system, so TLS connect/reconnect cycles do not fragment the heap and the memory used by
+    // mbedtls never exceeds the arena capacity.
+    class TlsMemoryPool
+    {
+    public:
+        static bool Enable(size_t capacity);
+        static bool IsEnabled();
+        static TlsMemoryStats GetStats();
+
+    private:
+        static void *Calloc(size_t n, size_t size);
+        static void Free(void *ptr);
+    };
+}
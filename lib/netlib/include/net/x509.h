@@ -23,5 +23,36 @@ namespace net
         private:
             Status m_lastError;
         };
+
+        // Read-only store of DER encoded CA certificates, sorted by subject name. Certificates are parsed only when
+        // they are needed to verify a chain, so a store may be shared by any number of connections and threads.
+        class CaStore
+        {
+        public:
+            class Entry
+            {
+            public:
+                size_t certOffset;
+                size_t certLen;
+                size_t subjectOffset;
+                size_t subjectLen;
+            };
+
+            CaStore(const unsigned char *data, const Entry *index, size_t count);
+            size_t GetCount() const;
+            int LoadAll(mbedtls_x509_crt& certificates) const;
+            int LoadIssuers(const mbedtls_x509_crt& chain, mbedtls_x509_crt& issuers) const;
+            int Verify(mbedtls_x509_crt& chain, const std::string& hostname, const mbedtls_x509_crt_profile *profile,
+                uint32_t& flags) const;
+            static const CaStore& GetDefault();
+
+        private:
+            const Entry * FindFirst(const mbedtls_x509_buf& subject) const;
+            bool IsSubject(const Entry *entry, const mbedtls_x509_buf& subject) const;
+
+            const unsigned char *m_data;
+            const Entry *m_index;
+            size_t m_count;
+        };
     }
 }
\ No newline at end of file
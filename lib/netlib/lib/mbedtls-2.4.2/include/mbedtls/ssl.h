@@ -812,6 +812,7 @@ struct mbedtls_ssl_context
      * Record layer (incoming data)
      */
     unsigned char *in_buf;      /*!< input buffer                     */
+    size_t in_buf_len;          /*!< size of the input buffer         */
     unsigned char *in_ctr;      /*!< 64-bit incoming message counter
                                      TLS: maintained by us
                                      DTLS: read from peer             */
@@ -843,6 +844,7 @@ struct mbedtls_ssl_context
      * Record layer (outgoing data)
      */
     unsigned char *out_buf;     /*!< output buffer                    */
+    size_t out_buf_len;         /*!< size of the output buffer        */
     unsigned char *out_ctr;     /*!< 64-bit outgoing message counter  */
     unsigned char *out_hdr;     /*!< start of record header           */
     unsigned char *out_len;     /*!< two-bytes message length field   */
@@ -145,6 +145,13 @@
                         + MBEDTLS_SSL_PADDING_ADD                   \
                         )
 
+/*
+ * The I/O buffers are allocated for the maximum fragment length, requested by
+ * the configuration. Room for the content of an outgoing message:
+ */
+#define MBEDTLS_SSL_OUT_CONTENT_LEN( ssl )                          \
+    ( ( ssl )->out_buf_len - ( MBEDTLS_SSL_BUFFER_LEN - MBEDTLS_SSL_MAX_CONTENT_LEN ) )
+
 /*
  * TLS extension flags (for extensions with outgoing ServerHello content
  * that need it (e.g. for RENEGOTIATION_INFO the server already knows because
@@ -378,6 +385,11 @@ int mbedtls_ssl_write_finished( mbedtls_ssl_context *ssl );
 void mbedtls_ssl_optimize_checksum( mbedtls_ssl_context *ssl,
                             const mbedtls_ssl_ciphersuite_t *ciphersuite_info );
 
+/*
+ * Grow the input buffer to len bytes, keeping its content
+ */
+int mbedtls_ssl_grow_in_buf( mbedtls_ssl_context *ssl, size_t len );
+
 #if defined(MBEDTLS_KEY_EXCHANGE__SOME__PSK_ENABLED)
 int mbedtls_ssl_psk_derive_premaster( mbedtls_ssl_context *ssl, mbedtls_key_exchange_type_t key_ex );
 #endif
@@ -81,6 +81,8 @@ static int wsa_init_done = 0;
 #include <fcntl.h>
 #include <netdb.h>
 #include <errno.h>
+#include <poll.h>
+#include <limits.h>
 
 #endif /* ( _WIN32 || _WIN32_WCE ) && !EFIX64 && !EFI32 */
 
@@ -496,13 +498,20 @@ int mbedtls_net_recv_timeout( void *ctx, unsigned char *buf, size_t len,
                       uint32_t timeout )
 {
     int ret;
+    int fd = ((mbedtls_net_context *) ctx)->fd;
+#if ( defined(_WIN32) || defined(_WIN32_WCE) ) && !defined(EFIX64) && \
+    !defined(EFI32)
     struct timeval tv;
     fd_set read_fds;
-    int fd = ((mbedtls_net_context *) ctx)->fd;
+#else
+    struct pollfd pfd;
+#endif
 
     if( fd < 0 )
         return( MBEDTLS_ERR_NET_INVALID_CONTEXT );
 
+#if ( defined(_WIN32) || defined(_WIN32_WCE) ) && !defined(EFIX64) && \
+    !defined(EFI32)
     FD_ZERO( &read_fds );
     FD_SET( fd, &read_fds );
 
@@ -510,6 +519,15 @@ int mbedtls_net_recv_timeout( void *ctx, unsigned char *buf, size_t len,
     tv.tv_usec = ( timeout % 1000 ) * 1000;
 
     ret = select( fd + 1, &read_fds, NULL, NULL, timeout == 0 ? NULL : &tv );
+#else
+    /* poll() has no FD_SETSIZE limit on the descriptor value */
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    ret = poll( &pfd, 1, timeout == 0 ? -1 :
+                ( timeout > INT_MAX ? INT_MAX : (int) timeout ) );
+#endif
 
     /* Zero fds ready means we timed out */
     if( ret == 0 )
@@ -92,7 +92,7 @@ namespace net
         }
 
 
-        Client::Client(Network & network) : m_network(network), m_timeout(0)
+        Client::Client(Network & network) : m_network(network), m_timeout(0), m_useKeepAlive(true)
         {
         }
 
@@ -101,6 +101,11 @@ namespace net
             m_timeout = timeoutMillisec;
         }
 
+        void Client::UseKeepAlive(bool useKeepAlive)
+        {
+            m_useKeepAlive = useKeepAlive;
+        }
+
         const Response & Client::Execute(const Request & request)
         {
             m_response.Reset();
@@ -120,27 +125,42 @@ namespace net
                 return m_response;
             }
 
-            if (!m_network.ConnectTo(request.url, m_timeout))
+            size_t received = 0;
+            bool keepAlive = false;
+            while (true)
             {
-                m_error = m_network.GetLastError();
-                m_response.executeStatus = NETWORK_ERROR;
-                return m_response;
-            }
+                if (!m_network.ConnectTo(request.url, m_timeout))
+                {
+                    m_error = m_network.GetLastError();
+                    m_response.executeStatus = NETWORK_ERROR;
+                    return m_response;
+                }
+
+                if (SendRequest(request, method) && ReadResponse(received, keepAlive))
+                {
+                    break;
+                }
 
-            if (!SendRequest(request, method))
-            {
                 m_network.Close();
-                return m_response;
+
+                // A pooled connection may have been closed by the server while idle - retry on another one
+                if (!m_network.IsReused() || received > 0)
+                {
+                    return m_response;
+                }
+
+                m_response.Reset();
             }
 
-            if (!ReadResponse())
+            if (m_useKeepAlive && keepAlive)
+            {
+                m_network.Release();
+            }
+            else
             {
                 m_network.Close();
-                return m_response;
             }
 
-            m_network.Close();
-
             m_response.executeStatus = SUCCESS;
             return m_response;
         }
@@ -162,7 +182,7 @@ namespace net
                 sendRequestBody = true;
                 headers["Content-Length"] = fmt::sprintf("%lu", request.data.length());
             }
-            headers["Connection"] = "close";
+            headers["Connection"] = m_useKeepAlive ? "keep-alive" : "close";
             headers.insert(request.headers.begin(), request.headers.end());
 
             for (StringMap::const_iterator header = headers.begin(); header != headers.end(); ++header)
@@ -210,11 +230,13 @@ namespace net
             return true;
         }
 
-        bool Client::ReadResponse()
+        bool Client::ReadResponse(size_t& received, bool& keepAlive)
         {
             unsigned char buf[10 * 1024];
             int len = 0;
             ResponseParser parser(m_response);
+            received = 0;
+            keepAlive = false;
 
             while (!parser.IsComplete())
             {
@@ -225,6 +247,7 @@ namespace net
                     break;
                 }
 
+                received += len;
                 parser.Feed(buf, len);
             }
 
@@ -235,6 +258,7 @@ namespace net
                 return false;
             }
 
+            keepAlive = parser.ShouldKeepAlive();
             return true;
         }
 
@@ -244,11 +268,41 @@ namespace net
         }
 
 
-        NetworkImpl::NetworkImpl() : m_connection(NULL) {}
+        NetworkImpl::IdleConnection::IdleConnection(const std::string & _key, Connection * _connection) :
+            key(_key), connection(_connection), idleSince(time(NULL))
+        {
+        }
+
+        NetworkImpl::NetworkImpl() :
+            m_caChain(NULL), m_tlsContext(NULL), m_maxIdleConnections(4), m_idleTimeout(30), m_connection(NULL), m_reused(false)
+        {
+        }
+
+        NetworkImpl::~NetworkImpl()
+        {
+            Close();
+            DropIdleConnections(0);
+        }
+
+        void NetworkImpl::SetMaxIdleConnections(size_t maxIdleConnections)
+        {
+            m_maxIdleConnections = maxIdleConnections;
+            DropIdleConnections(m_maxIdleConnections);
+        }
+
+        void NetworkImpl::SetIdleTimeout(int idleTimeoutSec)
+        {
+            m_idleTimeout = idleTimeoutSec;
+        }
 
         void NetworkImpl::SetX509CaChain(x509::CaChain & caChain)
         {
-            m_tlsConnection.SetX509CaChain(caChain);
+            m_caChain = &caChain;
+        }
+
+        void NetworkImpl::SetTlsContext(TlsContext & context)
+        {
+            m_tlsContext = &context;
         }
 
         bool NetworkImpl::ConnectTo(const Url & url, int timeoutMillisec)
@@ -258,24 +312,41 @@ namespace net
                 Close();
             }
 
-            if (url.scheme == "http")
+            if (url.scheme != "http" && url.scheme != "https")
+            {
+                m_error.Set(-1, fmt::sprintf("Unsupported protocol for URL: %s", url), "NetworkImpl::ConnectTo");
+                return false;
+            }
+
+            m_connectionKey = fmt::sprintf("%s://%s:%s", url.scheme, url.addr.host, url.addr.port);
+            m_connection = TakeIdleConnection(m_connectionKey);
+            if (m_connection != NULL)
             {
-                m_connection = &m_tcpConnection;
+                m_reused = true;
+                m_error.Clear();
+                return true;
             }
-            else if (url.scheme == "https")
+
+            m_reused = false;
+            if (url.scheme == "http")
             {
-                m_connection = &m_tlsConnection;
+                m_connection = new TcpConnection();
             }
             else
             {
-                m_error.Set(-1, fmt::sprintf("Unsupported protocol for URL: %s", url), "NetworkImpl::ConnectTo");
-                return false;
+                TlsConnection *tlsConnection = new TlsConnection(m_tlsContext != NULL ? *m_tlsContext : TlsContext::GetDefault());
+                if (m_caChain != NULL)
+                {
+                    tlsConnection->SetX509CaChain(*m_caChain);
+                }
+                m_connection = tlsConnection;
             }
 
             m_connection->SetAddress(url.addr);
             if (m_connection->Connect() != 0)
             {
                 m_error = m_connection->GetLastError();
+                delete m_connection;
                 m_connection = NULL;
                 return false;
             }
@@ -289,10 +360,86 @@ namespace net
             if (m_connection != NULL)
             {
                 m_connection->Close();
+                delete m_connection;
                 m_connection = NULL;
             }
         }
 
+        void NetworkImpl::Release()
+        {
+            if (m_connection == NULL)
+            {
+                return;
+            }
+
+            if (m_maxIdleConnections == 0 || !m_connection->IsConnected())
+            {
+                Close();
+                return;
+            }
+
+            m_idleConnections.push_front(IdleConnection(m_connectionKey, m_connection));
+            m_connection = NULL;
+            DropIdleConnections(m_maxIdleConnections);
+        }
+
+        bool NetworkImpl::IsReused() const
+        {
+            return m_reused;
+        }
+
+        Connection * NetworkImpl::TakeIdleConnection(const std::string & key)
+        {
+            time_t now = time(NULL);
+            IdleConnections::iterator i = m_idleConnections.begin();
+            while (i != m_idleConnections.end())
+            {
+                if (now - i->idleSince >= m_idleTimeout || !i->connection->IsConnected())
+                {
+                    i->connection->Close();
+                    delete i->connection;
+                    i = m_idleConnections.erase(i);
+                    continue;
+                }
+
+                if (i->key == key)
+                {
+                    Connection *connection = i->connection;
+                    m_idleConnections.erase(i);
+                    if (IsAlive(connection))
+                    {
+                        return connection;
+                    }
+
+                    connection->Close();
+                    delete connection;
+                    return TakeIdleConnection(key);
+                }
+
+                ++i;
+            }
+
+            return NULL;
+        }
+
+        void NetworkImpl::DropIdleConnections(size_t maxCount)
+        {
+            while (m_idleConnections.size() > maxCount)
+            {
+                m_idleConnections.back().connection->Close();
+                delete m_idleConnections.back().connection;
+                m_idleConnections.pop_back();
+            }
+        }
+
+        bool NetworkImpl::IsAlive(Connection * connection)
+        {
+            // An idle connection must not have anything to read. If the server has closed it, the read fails.
+            unsigned char c;
+            int res = connection->Read(&c, 1, 1);
+            return res <= 0 && connection->IsTimedOut() && connection->IsConnected();
+        }
+
         int NetworkImpl::Read(unsigned char * buffer, int len, int timeoutMillisec)
         {
             if (m_connection == NULL)
@@ -303,7 +450,8 @@ namespace net
             int res = m_connection->Read(buffer, len, timeoutMillisec);
             if (!m_connection->IsConnected())
             {
-                m_connection = NULL;
+                m_error = m_connection->GetLastError();
+                Close();
             }
 
             return res;
@@ -319,7 +467,8 @@ namespace net
             int res = m_connection->Write(buffer, len, timeoutMillisec);
             if (!m_connection->IsConnected())
             {
-                m_connection = NULL;
+                m_error = m_connection->GetLastError();
+                Close();
             }
 
             return res;
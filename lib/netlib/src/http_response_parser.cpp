@@ -72,6 +72,11 @@ namespace net
             return m_error.code != 0;
         }
 
+        bool ResponseParser::ShouldKeepAlive()
+        {
+            return m_isComplete && http_should_keep_alive(&m_parser) != 0;
+        }
+
         const net::Status & ResponseParser::GetLastError() const
         {
             return m_error;
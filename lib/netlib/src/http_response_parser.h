@@ -18,6 +18,7 @@ namespace net
             void FeedEOF();
             bool IsComplete();
             bool HasErrors();
+            bool ShouldKeepAlive();
             const net::Status& GetLastError() const;
 
         private:
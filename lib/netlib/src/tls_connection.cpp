@@ -1,49 +1,141 @@
 #include "net/tls_connection.h"
 #include "utils.h"
+#include "mbedtls/ssl_internal.h"
+#include <string.h>
 #ifdef _WIN32
 #include "winsock2.h"
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <poll.h>
 #endif
 
 namespace net
 {
-    TlsConnection::TlsConnection() : m_rngSeeded(false)
+    TlsConnection::TlsConnection() :
+        m_context(TlsContext::GetDefault()), m_ownConf(NULL), m_socketOpen(false), m_handshakeFailed(false), m_sendTimeout(0), m_readTimeout(0),
+        m_mflCode(MBEDTLS_SSL_MAX_FRAG_LEN_NONE), m_sessionSaved(false), m_sessionResumed(false), m_useSessionResumption(true), m_handshakeCount(0),
+        m_resumedHandshakeCount(0)
     {
-        mbedtls_entropy_init(&m_entropy);
-        mbedtls_ctr_drbg_init(&m_rng);
+        mbedtls_ssl_session_init(&m_session);
+    }
 
-        mbedtls_ssl_config_init(&m_conf);
-        mbedtls_ssl_config_defaults(&m_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
-        mbedtls_ssl_conf_rng(&m_conf, mbedtls_ctr_drbg_random, &m_rng);
+    TlsConnection::TlsConnection(TlsContext & context) :
+        m_context(context), m_ownConf(NULL), m_socketOpen(false), m_handshakeFailed(false), m_sendTimeout(0), m_readTimeout(0),
+        m_mflCode(MBEDTLS_SSL_MAX_FRAG_LEN_NONE), m_sessionSaved(false), m_sessionResumed(false), m_useSessionResumption(true), m_handshakeCount(0),
+        m_resumedHandshakeCount(0)
+    {
+        mbedtls_ssl_session_init(&m_session);
     }
 
     TlsConnection::~TlsConnection()
     {
         Close();
+        ClearSession();
 
-        mbedtls_entropy_free(&m_entropy);
-        mbedtls_ctr_drbg_free(&m_rng);
-        mbedtls_ssl_config_free(&m_conf);
+        if (m_ownConf != NULL)
+        {
+            mbedtls_ssl_config_free(m_ownConf);
+            delete m_ownConf;
+        }
     }
 
     void TlsConnection::SetPsk(const std::string & psk, const std::string & pskId)
     {
+        if (psk != m_psk || pskId != m_pskId)
+        {
+            ClearSession();
+        }
+
         m_psk = psk;
         m_pskId = pskId;
-        mbedtls_ssl_conf_psk(&m_conf, ToUnsignedChar(m_psk), m_psk.length(), ToUnsignedChar(m_pskId), m_pskId.length());
+        mbedtls_ssl_conf_psk(GetOwnConfig(), ToUnsignedChar(m_psk), m_psk.length(), ToUnsignedChar(m_pskId), m_pskId.length());
     }
 
     void TlsConnection::SetX509CaChain(x509::CaChain & caChain)
     {
-        mbedtls_ssl_conf_ca_chain(&m_conf, &caChain.certificates, NULL);
-        mbedtls_ssl_conf_authmode(&m_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_config *conf = GetOwnConfig();
+        mbedtls_ssl_conf_ca_chain(conf, &caChain.certificates, NULL);
+        mbedtls_ssl_conf_authmode(conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    }
+
+    void TlsConnection::UseSessionResumption(bool useSessionResumption)
+    {
+        m_useSessionResumption = useSessionResumption;
+        if (!m_useSessionResumption)
+        {
+            ClearSession();
+        }
+    }
+
+    void TlsConnection::SetMaxFragmentLength(size_t maxFragmentLength)
+    {
+        // RFC 6066 allows only 512, 1024, 2048 and 4096 bytes - the length is rounded up to one of them
+        unsigned char mflCode = MBEDTLS_SSL_MAX_FRAG_LEN_NONE;
+        if (maxFragmentLength > 0)
+        {
+            mflCode = MBEDTLS_SSL_MAX_FRAG_LEN_512;
+            for (size_t len = 512; len < maxFragmentLength && mflCode < MBEDTLS_SSL_MAX_FRAG_LEN_INVALID; len *= 2)
+            {
+                ++mflCode;
+            }
+            if (mflCode == MBEDTLS_SSL_MAX_FRAG_LEN_INVALID)
+            {
+                mflCode = MBEDTLS_SSL_MAX_FRAG_LEN_NONE;
+            }
+        }
+
+        if (mflCode == m_mflCode)
+        {
+            return;
+        }
+
+        // The fragment length is negotiated for the whole session
+        ClearSession();
+        m_mflCode = mflCode;
+        mbedtls_ssl_conf_max_frag_len(GetOwnConfig(), m_mflCode);
+    }
+
+    void TlsConnection::ClearSession()
+    {
+        mbedtls_ssl_session_free(&m_session);
+        mbedtls_ssl_session_init(&m_session);
+        m_sessionHost.clear();
+        m_sessionSaved = false;
+    }
+
+    int TlsConnection::OpenSocket()
+    {
+        if (m_connected || m_socketOpen)
+        {
+            return 0;
+        }
+
+        mbedtls_net_init(&m_socket);
+        int ret = mbedtls_net_connect(&m_socket, m_addr.host.c_str(), m_addr.port.c_str(), MBEDTLS_NET_PROTO_TCP);
+        if (ret)
+        {
+            mbedtls_net_free(&m_socket);
+            return m_lastError.Set(ret, mbedtls::strerror(ret), "mbedtls_net_connect");
+        }
+
+        m_socketOpen = true;
+        m_socketAddr = m_addr.host + ":" + m_addr.port;
+        return 0;
+    }
+
+    void TlsConnection::CloseSocket()
+    {
+        if (m_socketOpen)
+        {
+            mbedtls_net_free(&m_socket);
+            m_socketOpen = false;
+        }
     }
 
-    void TlsConnection::SetPersonalizationData(const std::string & data)
+    bool TlsConnection::IsSocketOpen() const
     {
-        m_persData = data;
+        return m_socketOpen;
     }
 
     int TlsConnection::Connect()
@@ -54,26 +146,27 @@ namespace net
         }
 
         int ret = 0;
+        m_handshakeFailed = false;
+        m_sessionResumed = false;
 
-        if (!m_rngSeeded)
+        if (!m_context.IsInitialized())
         {
-            ret = mbedtls_ctr_drbg_seed(&m_rng, mbedtls_entropy_func, &m_entropy, ToUnsignedChar(m_persData), m_persData.length());
-            if (ret)
-            {
-                return m_lastError.Set(ret, mbedtls::strerror(ret), "mbedtls_ctr_drbg_seed");
-            }
-            m_rngSeeded = true;
+            const Status& error = m_context.GetLastError();
+            return m_lastError.Set(error.code, error.error, error.failedFunc);
         }
 
+        const mbedtls_ssl_config *conf = GetConfig();
         mbedtls_ssl_init(&m_ssl);
-        ret = mbedtls_ssl_setup(&m_ssl, &m_conf);
+        ret = mbedtls_ssl_setup(&m_ssl, conf);
         if (ret)
         {
             mbedtls_ssl_free(&m_ssl);
             return m_lastError.Set(ret, mbedtls::strerror(ret), "mbedtls_ssl_setup");
         }
 
-        if(m_conf.ca_chain)
+        // A CA store is used only while the connection has no CA chain of its own
+        const x509::CaStore *caStore = conf->ca_chain == NULL ? m_context.GetX509CaStore() : NULL;
+        if(conf->ca_chain || caStore != NULL)
         {
             ret = mbedtls_ssl_set_hostname(&m_ssl, m_addr.host.c_str());
             if (ret)
@@ -82,27 +175,59 @@ namespace net
             }
         }
 
-        mbedtls_net_init(&m_socket);
-        ret = mbedtls_net_connect(&m_socket, m_addr.host.c_str(), m_addr.port.c_str(), MBEDTLS_NET_PROTO_TCP);
+        std::string sessionHost = m_addr.host + ":" + m_addr.port;
+        if (m_sessionSaved && m_sessionHost == sessionHost)
+        {
+            ret = mbedtls_ssl_set_session(&m_ssl, &m_session);
+            if (ret)
+            {
+                ClearSession();
+            }
+        }
+
+        if (m_socketAddr != sessionHost)
+        {
+            CloseSocket();
+        }
+
+        ret = OpenSocket();
         if (ret)
         {
-            mbedtls_net_free(&m_socket);
             mbedtls_ssl_free(&m_ssl);
-            return m_lastError.Set(ret, mbedtls::strerror(ret), "mbedtls_net_connect");
+            return ret;
         }
+        // The socket is owned by the connection from now on
+        m_socketOpen = false;
 
-        mbedtls_ssl_set_bio(&m_ssl, &m_socket, mbedtls_net_send, NULL, mbedtls_net_recv_timeout);
+        m_readTimeout = 0;
+        mbedtls_ssl_set_bio(&m_ssl, this, Send, NULL, Recv);
 
-        ret = mbedtls_ssl_handshake(&m_ssl);
+        ret = Handshake(caStore);
         if (ret)
         {
             mbedtls_net_free(&m_socket);
             mbedtls_ssl_free(&m_ssl);
+            m_handshakeFailed = true;
+            ClearSession();
             return m_lastError.Set(ret, mbedtls::strerror(ret), "mbedtls_ssl_handshake");
         }
 
+        ++m_handshakeCount;
+        if (IsSavedSessionResumed())
+        {
+            m_sessionResumed = true;
+            ++m_resumedHandshakeCount;
+        }
+
+        if (m_useSessionResumption)
+        {
+            SaveSession();
+            m_sessionHost = sessionHost;
+        }
+
         m_connected = true;
         m_timedOut = false;
+        m_sendTimeout = 0;
         m_lastError.Clear();
         return 0;
     }
@@ -111,6 +236,7 @@ namespace net
     {
         if (!m_connected)
         {
+            CloseSocket();
             return;
         }
 
@@ -121,6 +247,210 @@ namespace net
         m_connected = false;
     }
 
+    bool TlsConnection::IsHandshakeFailed() const
+    {
+        return m_handshakeFailed;
+    }
+
+    bool TlsConnection::IsSessionResumed() const
+    {
+        return m_sessionResumed;
+    }
+
+    unsigned long TlsConnection::GetHandshakeCount() const
+    {
+        return m_handshakeCount;
+    }
+
+    unsigned long TlsConnection::GetResumedHandshakeCount() const
+    {
+        return m_resumedHandshakeCount;
+    }
+
+    int TlsConnection::GetSocket() const
+    {
+        return m_connected ? m_socket.fd : -1;
+    }
+
+    size_t TlsConnection::GetBytesAvailable() const
+    {
+        return m_connected ? mbedtls_ssl_get_bytes_avail(&m_ssl) : 0;
+    }
+
+    size_t TlsConnection::GetMaxRecordSize() const
+    {
+        if (m_connected)
+        {
+            return mbedtls_ssl_get_max_frag_len(&m_ssl);
+        }
+        return m_mflCode == MBEDTLS_SSL_MAX_FRAG_LEN_NONE ? MBEDTLS_SSL_MAX_CONTENT_LEN : (256u << m_mflCode);
+    }
+
+    size_t TlsConnection::GetBufferSize() const
+    {
+        return m_connected ? m_ssl.in_buf_len + m_ssl.out_buf_len : 0;
+    }
+
+    void TlsConnection::SaveSession()
+    {
+        ClearSession();
+        if (mbedtls_ssl_get_session(&m_ssl, &m_session) == 0)
+        {
+            m_sessionSaved = true;
+        }
+        else
+        {
+            ClearSession();
+        }
+    }
+
+    int TlsConnection::Handshake(const x509::CaStore * caStore)
+    {
+        bool verified = false;
+        while (m_ssl.state != MBEDTLS_SSL_HANDSHAKE_OVER)
+        {
+            bool serverCertificate = m_ssl.state == MBEDTLS_SSL_SERVER_CERTIFICATE;
+            int ret = mbedtls_ssl_handshake_step(&m_ssl);
+            if (ret)
+            {
+                return ret;
+            }
+
+            // Verify the server certificate before the key exchange, as mbedtls does with a CA chain
+            if (serverCertificate && caStore != NULL && m_ssl.session_negotiate->peer_cert != NULL)
+            {
+                ret = VerifyServerCertificate(*caStore);
+                if (ret)
+                {
+                    return ret;
+                }
+                verified = true;
+            }
+        }
+
+        // The steps above depend on the internals of mbedtls, so a certificate, which should have been verified,
+        // but was not, fails the handshake instead of being trusted
+        if (caStore != NULL && !verified && IsServerCertificateExpected())
+        {
+            mbedtls_ssl_send_alert_message(&m_ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL, MBEDTLS_SSL_ALERT_MSG_BAD_CERT);
+            return MBEDTLS_ERR_SSL_PEER_VERIFY_FAILED;
+        }
+        return 0;
+    }
+
+    // Called after the handshake. The server sends no certificate for a resumed session, as well as for the key
+    // exchanges, which do not use one.
+    bool TlsConnection::IsServerCertificateExpected() const
+    {
+        if (IsSavedSessionResumed())
+        {
+            return false;
+        }
+
+        const mbedtls_ssl_ciphersuite_t *ciphersuite = mbedtls_ssl_ciphersuite_from_id(m_ssl.session->ciphersuite);
+        if (ciphersuite == NULL)
+        {
+            return true;
+        }
+
+        switch (ciphersuite->key_exchange)
+        {
+        case MBEDTLS_KEY_EXCHANGE_PSK:
+        case MBEDTLS_KEY_EXCHANGE_DHE_PSK:
+        case MBEDTLS_KEY_EXCHANGE_ECDHE_PSK:
+        case MBEDTLS_KEY_EXCHANGE_ECJPAKE:
+            return false;
+        default:
+            return true;
+        }
+    }
+
+    bool TlsConnection::IsSavedSessionResumed() const
+    {
+        return m_sessionSaved && m_session.id_len > 0 && m_ssl.session->id_len == m_session.id_len &&
+            memcmp(m_ssl.session->id, m_session.id, m_session.id_len) == 0;
+    }
+
+    int TlsConnection::VerifyServerCertificate(const x509::CaStore & caStore)
+    {
+        mbedtls_x509_crt *peerCert = m_ssl.session_negotiate->peer_cert;
+        uint32_t flags = 0;
+        int ret = caStore.Verify(*peerCert, m_addr.host, m_ssl.conf->cert_profile, flags);
+        if (ret == 0 && mbedtls_ssl_check_cert_usage(peerCert, m_ssl.transform_negotiate->ciphersuite_info,
+            MBEDTLS_SSL_IS_SERVER, &flags) != 0)
+        {
+            ret = MBEDTLS_ERR_SSL_BAD_HS_CERTIFICATE;
+        }
+
+        m_ssl.session_negotiate->verify_result = flags;
+        if (ret)
+        {
+            mbedtls_ssl_send_alert_message(&m_ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL, MBEDTLS_SSL_ALERT_MSG_BAD_CERT);
+        }
+        return ret;
+    }
+
+    mbedtls_ssl_config * TlsConnection::GetOwnConfig()
+    {
+        // A connection needs an own configuration only for the settings, which are not shared with the context
+        if (m_ownConf == NULL)
+        {
+            m_ownConf = new mbedtls_ssl_config;
+            mbedtls_ssl_config_init(m_ownConf);
+            m_context.SetupConfig(*m_ownConf);
+            const mbedtls_ssl_config *shared = m_context.GetConfig();
+            mbedtls_ssl_conf_ca_chain(m_ownConf, shared->ca_chain, shared->ca_crl);
+            mbedtls_ssl_conf_authmode(m_ownConf, shared->authmode);
+        }
+        return m_ownConf;
+    }
+
+    const mbedtls_ssl_config * TlsConnection::GetConfig() const
+    {
+        return m_ownConf != NULL ? m_ownConf : m_context.GetConfig();
+    }
+
+    int TlsConnection::Send(void * ctx, const unsigned char * buf, size_t len)
+    {
+        return mbedtls_net_send(&static_cast<TlsConnection *>(ctx)->m_socket, buf, len);
+    }
+
+    // The read timeout is kept by the connection, as the configuration may be shared with other connections
+    int TlsConnection::Recv(void * ctx, unsigned char * buf, size_t len, uint32_t /*timeout*/)
+    {
+        TlsConnection *connection = static_cast<TlsConnection *>(ctx);
+        if (connection->m_readTimeout >= 0)
+        {
+            return mbedtls_net_recv_timeout(&connection->m_socket, buf, len, connection->m_readTimeout);
+        }
+
+        // Negative timeout - do not wait for the socket to become readable. poll is used, as select can not watch
+        // descriptors above FD_SETSIZE, which a process with many connections easily has.
+        int fd = connection->m_socket.fd;
+#ifdef _WIN32
+        fd_set readFds;
+        FD_ZERO(&readFds);
+        FD_SET(static_cast<SOCKET>(fd), &readFds);
+        struct timeval tv = { 0, 0 };
+        int ret = select(fd + 1, &readFds, NULL, NULL, &tv);
+#else
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int ret = poll(&pfd, 1, 0);
+#endif
+        if (ret < 0)
+        {
+            return MBEDTLS_ERR_NET_RECV_FAILED;
+        }
+        if (ret == 0)
+        {
+            return MBEDTLS_ERR_SSL_WANT_READ;
+        }
+        return mbedtls_net_recv(&connection->m_socket, buf, len);
+    }
+
     std::string TlsConnection::GetCiphersuite() const
     {
         if (!m_connected)
@@ -144,8 +474,7 @@ namespace net
         }
 
         m_timedOut = false;
-
-        mbedtls_ssl_conf_read_timeout(&m_conf, timeoutMillisec);
+        m_readTimeout = timeoutMillisec;
 
         int ret = mbedtls_ssl_read(&m_ssl, buffer, len);
         if (ret <= 0)
@@ -165,7 +494,37 @@ namespace net
             }
         }
 
-        mbedtls_ssl_conf_read_timeout(&m_conf, 0);
+        return ret;
+    }
+
+    int TlsConnection::ReadAvailable(unsigned char * buffer, int len)
+    {
+        if (!m_connected)
+        {
+            return m_lastError.Set(-1, "Network disconnected", "TlsConnection::read");
+        }
+
+        m_timedOut = false;
+
+        // Data of a partially received record is kept by mbedtls until the rest of the record arrives
+        m_readTimeout = -1;
+        int ret = mbedtls_ssl_read(&m_ssl, buffer, len);
+
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ)
+        {
+            return 0;
+        }
+        if (ret == 0)
+        {
+            // 0 means that no data is available, so the end of the stream is reported as an error
+            ret = m_lastError.Set(-1, "Connection closed by peer", "mbedtls_ssl_read");
+            Close();
+        }
+        else if (ret < 0)
+        {
+            m_lastError.Set(ret, mbedtls::strerror(ret), "mbedtls_ssl_read");
+            Close();
+        }
         return ret;
     }
 
@@ -182,8 +541,7 @@ namespace net
         }
 
         m_timedOut = false;
-
-        mbedtls_ssl_conf_read_timeout(&m_conf, timeoutMillisec);
+        m_readTimeout = timeoutMillisec;
 
         int received = 0;
         while (received < len)
@@ -207,7 +565,6 @@ namespace net
             received += ret;
         }
 
-        mbedtls_ssl_conf_read_timeout(&m_conf, 0);
         return received;
     }
 
@@ -228,8 +585,13 @@ namespace net
             return 0;
         }
 
-        timeval tv = { timeoutMillisec / 1000, (timeoutMillisec % 1000) * 1000 };
-        setsockopt(m_socket.fd, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<char*>(&tv), sizeof(struct timeval));
+        // The socket keeps the send timeout - it is changed only when a different one is requested
+        if (timeoutMillisec != m_sendTimeout)
+        {
+            timeval tv = { timeoutMillisec / 1000, (timeoutMillisec % 1000) * 1000 };
+            setsockopt(m_socket.fd, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<char*>(&tv), sizeof(struct timeval));
+            m_sendTimeout = timeoutMillisec;
+        }
 
         int ret = mbedtls_ssl_write(&m_ssl, buffer, len);
         if (ret <= 0)
@@ -239,10 +601,6 @@ namespace net
             return ret;
         }
 
-        tv.tv_sec = 0;
-        tv.tv_usec = 0;
-        setsockopt(m_socket.fd, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<char*>(&tv), sizeof(struct timeval));
-
         return ret;
     }
 }
@@ -0,0 +1,117 @@
+#include "net/tls_context.h"
+#include "utils.h"
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace net
+{
+    TlsContext::TlsContext() : m_caStore(NULL), m_initialized(false)
+    {
+        Init("");
+    }
+
+    TlsContext::TlsContext(const std::string & personalizationData) : m_caStore(NULL), m_initialized(false)
+    {
+        Init(personalizationData);
+    }
+
+    TlsContext::~TlsContext()
+    {
+        mbedtls_ssl_config_free(&m_conf);
+        mbedtls_ctr_drbg_free(&m_rng);
+        mbedtls_entropy_free(&m_entropy);
+#ifdef _WIN32
+        CRITICAL_SECTION *lock = static_cast<CRITICAL_SECTION *>(m_rngLock);
+        DeleteCriticalSection(lock);
+        delete lock;
+#endif
+    }
+
+    void TlsContext::Init(const std::string & personalizationData)
+    {
+#ifdef _WIN32
+        // mbedtls is built without a threading layer on Windows, so the shared generator is locked here
+        CRITICAL_SECTION *lock = new CRITICAL_SECTION;
+        InitializeCriticalSection(lock);
+        m_rngLock = lock;
+#endif
+
+        mbedtls_entropy_init(&m_entropy);
+        mbedtls_ctr_drbg_init(&m_rng);
+        mbedtls_ssl_config_init(&m_conf);
+
+        int ret = mbedtls_ctr_drbg_seed(&m_rng, mbedtls_entropy_func, &m_entropy,
+            ToUnsignedChar(personalizationData), personalizationData.length());
+        if (ret)
+        {
+            m_lastError.Set(ret, mbedtls::strerror(ret), "mbedtls_ctr_drbg_seed");
+            return;
+        }
+
+        SetupConfig(m_conf);
+        m_initialized = true;
+    }
+
+    bool TlsContext::IsInitialized() const
+    {
+        return m_initialized;
+    }
+
+    void TlsContext::SetX509CaChain(x509::CaChain & caChain)
+    {
+        m_caStore = NULL;
+        mbedtls_ssl_conf_ca_chain(&m_conf, &caChain.certificates, NULL);
+        mbedtls_ssl_conf_authmode(&m_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    }
+
+    void TlsContext::SetX509CaStore(const x509::CaStore & caStore)
+    {
+        // mbedtls can not look up the CA certificates on demand, so the server certificate is verified by the
+        // connections against the store, after mbedtls parses it
+        m_caStore = &caStore;
+        mbedtls_ssl_conf_ca_chain(&m_conf, NULL, NULL);
+        mbedtls_ssl_conf_authmode(&m_conf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+
+    const x509::CaStore * TlsContext::GetX509CaStore() const
+    {
+        return m_caStore;
+    }
+
+    const mbedtls_ssl_config * TlsContext::GetConfig() const
+    {
+        return &m_conf;
+    }
+
+    void TlsContext::SetupConfig(mbedtls_ssl_config & conf) const
+    {
+        mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+        mbedtls_ssl_conf_rng(&conf, Random, const_cast<TlsContext *>(this));
+    }
+
+    const Status & TlsContext::GetLastError() const
+    {
+        return m_lastError;
+    }
+
+    TlsContext & TlsContext::GetDefault()
+    {
+        static TlsContext context;
+        return context;
+    }
+
+    int TlsContext::Random(void * ctx, unsigned char * output, size_t len)
+    {
+        TlsContext *context = static_cast<TlsContext *>(ctx);
+#ifdef _WIN32
+        CRITICAL_SECTION *lock = static_cast<CRITICAL_SECTION *>(context->m_rngLock);
+        EnterCriticalSection(lock);
+        int ret = mbedtls_ctr_drbg_random(&context->m_rng, output, len);
+        LeaveCriticalSection(lock);
+        return ret;
+#else
+        return mbedtls_ctr_drbg_random(&context->m_rng, output, len);
+#endif
+    }
+}
@@ -0,0 +1,223 @@
+#include "net/tls_memory_pool.h"
+#include "mbedtls/platform.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+namespace net
+{
+    namespace
+    {
+        // Every block starts with a header, which keeps the payload aligned for any mbedtls structure
+        const size_t HEADER_SIZE = 16;
+        const size_t MIN_BLOCK_SIZE = 16;
+        const size_t MAX_BLOCK_SIZE = 32 * 1024;
+        const size_t MAX_SIZE_CLASSES = 64;
+
+        struct BlockHeader
+        {
+            unsigned int sizeClass;
+            unsigned int requested;
+        };
+
+        class Pool
+        {
+        public:
+            Pool() : arena(NULL), sizeClassCount(0)
+            {
+                memset(sizeClasses, 0, sizeof(sizeClasses));
+                memset(freeLists, 0, sizeof(freeLists));
+            }
+
+            void Lock()
+            {
+#ifdef _WIN32
+                EnterCriticalSection(&lock);
+#else
+                pthread_mutex_lock(&lock);
+#endif
+            }
+
+            void Unlock()
+            {
+#ifdef _WIN32
+                LeaveCriticalSection(&lock);
+#else
+                pthread_mutex_unlock(&lock);
+#endif
+            }
+
+            bool Contains(const void *ptr) const
+            {
+                const unsigned char *p = static_cast<const unsigned char *>(ptr);
+                return arena != NULL && p >= arena && p < arena + stats.capacity;
+            }
+
+            unsigned char *arena;
+            // Block sizes grow in quarters of a power of two, so the rounding wastes at most 25% of a block
+            size_t sizeClasses[MAX_SIZE_CLASSES];
+            size_t sizeClassCount;
+            unsigned char *freeLists[MAX_SIZE_CLASSES];
+            TlsMemoryStats stats;
+#ifdef _WIN32
+            CRITICAL_SECTION lock;
+#else
+            pthread_mutex_t lock;
+#endif
+        };
+
+        Pool pool;
+
+        BlockHeader *GetHeader(void *ptr)
+        {
+            return reinterpret_cast<BlockHeader *>(static_cast<unsigned char *>(ptr) - HEADER_SIZE);
+        }
+    }
+
+    TlsMemoryStats::TlsMemoryStats() :
+        capacity(0), reservedBytes(0), usedBytes(0), usedBytesMax(0), requestedBytes(0), allocations(0),
+        failedAllocations(0)
+    {
+    }
+
+    bool TlsMemoryPool::Enable(size_t capacity)
+    {
+        if (pool.arena != NULL || capacity == 0)
+        {
+            return false;
+        }
+
+        unsigned char *arena = static_cast<unsigned char *>(malloc(capacity));
+        if (arena == NULL)
+        {
+            return false;
+        }
+
+        pool.sizeClassCount = 0;
+        for (size_t size = MIN_BLOCK_SIZE; size <= MAX_BLOCK_SIZE && pool.sizeClassCount < MAX_SIZE_CLASSES; )
+        {
+            pool.sizeClasses[pool.sizeClassCount++] = size;
+            size_t step = MIN_BLOCK_SIZE;
+            while (step * 8 <= size)
+            {
+                step *= 2;
+            }
+            size += step;
+        }
+
+#ifdef _WIN32
+        InitializeCriticalSection(&pool.lock);
+#else
+        pthread_mutex_init(&pool.lock, NULL);
+#endif
+        pool.arena = arena;
+        pool.stats.capacity = capacity;
+
+        // Memory, allocated by mbedtls before this point, is still released to the system by Free
+        return mbedtls_platform_set_calloc_free(Calloc, Free) == 0;
+    }
+
+    bool TlsMemoryPool::IsEnabled()
+    {
+        return pool.arena != NULL;
+    }
+
+    TlsMemoryStats TlsMemoryPool::GetStats()
+    {
+        if (pool.arena == NULL)
+        {
+            return TlsMemoryStats();
+        }
+
+        pool.Lock();
+        TlsMemoryStats stats = pool.stats;
+        pool.Unlock();
+        return stats;
+    }
+
+    void * TlsMemoryPool::Calloc(size_t n, size_t size)
+    {
+        size_t requested = n * size;
+        if (n != 0 && requested / n != size)
+        {
+            return NULL;
+        }
+
+        size_t sizeClass = 0;
+        while (sizeClass < pool.sizeClassCount && pool.sizeClasses[sizeClass] < requested)
+        {
+            ++sizeClass;
+        }
+
+        pool.Lock();
+
+        unsigned char *block = NULL;
+        if (sizeClass < pool.sizeClassCount)
+        {
+            size_t blockSize = HEADER_SIZE + pool.sizeClasses[sizeClass];
+            if (pool.freeLists[sizeClass] == NULL && pool.stats.reservedBytes + blockSize <= pool.stats.capacity)
+            {
+                block = pool.arena + pool.stats.reservedBytes;
+                pool.stats.reservedBytes += blockSize;
+                reinterpret_cast<BlockHeader *>(block)->sizeClass = static_cast<unsigned int>(sizeClass);
+            }
+            else
+            {
+                // When the arena is exhausted, a free block of a larger size is better than a failure
+                for (size_t i = sizeClass; i < pool.sizeClassCount && block == NULL; ++i)
+                {
+                    if (pool.freeLists[i] != NULL)
+                    {
+                        block = pool.freeLists[i];
+                        memcpy(&pool.freeLists[i], block + HEADER_SIZE, sizeof(unsigned char *));
+                    }
+                }
+            }
+        }
+
+        if (block == NULL)
+        {
+            ++pool.stats.failedAllocations;
+            pool.Unlock();
+            return NULL;
+        }
+
+        BlockHeader *header = reinterpret_cast<BlockHeader *>(block);
+        header->requested = static_cast<unsigned int>(requested);
+        pool.stats.usedBytes += HEADER_SIZE + pool.sizeClasses[header->sizeClass];
+        if (pool.stats.usedBytes > pool.stats.usedBytesMax)
+        {
+            pool.stats.usedBytesMax = pool.stats.usedBytes;
+        }
+        pool.stats.requestedBytes += requested;
+        ++pool.stats.allocations;
+
+        pool.Unlock();
+
+        memset(block + HEADER_SIZE, 0, requested);
+        return block + HEADER_SIZE;
+    }
+
+    void TlsMemoryPool::Free(void * ptr)
+    {
+        if (!pool.Contains(ptr))
+        {
+            free(ptr);
+            return;
+        }
+
+        BlockHeader *header = GetHeader(ptr);
+        unsigned char *block = reinterpret_cast<unsigned char *>(header);
+
+        pool.Lock();
+        pool.stats.usedBytes -= HEADER_SIZE + pool.sizeClasses[header->sizeClass];
+        pool.stats.requestedBytes -= header->requested;
+        memcpy(block + HEADER_SIZE, &pool.freeLists[header->sizeClass], sizeof(unsigned char *));
+        pool.freeLists[header->sizeClass] = block;
+        pool.Unlock();
+    }
+}
@@ -1,6 +1,9 @@
 #include <net/x509.h>
 #include "utils.h"
 #include <mbedtls/ssl.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
 
 namespace net
 {
@@ -36,21 +39,150 @@ namespace net
             return res;
         }
 
+        int CaChain::LoadDefaultData()
+        {
+            int res = CaStore::GetDefault().LoadAll(certificates);
+            if (res < 0)
+            {
+                return m_lastError.Set(res, mbedtls::strerror(res), "mbedtls_x509_crt_parse_der");
+            }
+            return res;
+        }
+
+        const Status & CaChain::GetLastError() const
+        {
+            return m_lastError;
+        }
+
         namespace
         {
-            static unsigned char CACERT_DATA[] = {
-                #include "cacert.inc"
-            };
+            // The CA bundle from cacert.inc, converted by tools/cacert_der
+            #include "cacert_der.inc"
+
+            int Compare(const unsigned char *p1, size_t len1, const unsigned char *p2, size_t len2)
+            {
+                int res = memcmp(p1, p2, std::min(len1, len2));
+                if (res != 0)
+                {
+                    return res;
+                }
+                return len1 < len2 ? -1 : (len1 > len2 ? 1 : 0);
+            }
         }
 
-        int CaChain::LoadDefaultData()
+        CaStore::CaStore(const unsigned char * data, const Entry * index, size_t count) :
+            m_data(data), m_index(index), m_count(count)
         {
-            return LoadPemData(CACERT_DATA, sizeof(CACERT_DATA));
         }
 
-        const Status & CaChain::GetLastError() const
+        size_t CaStore::GetCount() const
         {
-            return m_lastError;
+            return m_count;
+        }
+
+        int CaStore::LoadAll(mbedtls_x509_crt & certificates) const
+        {
+            for (size_t i = 0; i < m_count; ++i)
+            {
+                int res = mbedtls_x509_crt_parse_der(&certificates, m_data + m_index[i].certOffset, m_index[i].certLen);
+                if (res != 0)
+                {
+                    return res;
+                }
+            }
+            return 0;
+        }
+
+        int CaStore::LoadIssuers(const mbedtls_x509_crt & chain, mbedtls_x509_crt & issuers) const
+        {
+            std::vector<bool> loaded(m_count, false);
+            std::vector<const mbedtls_x509_buf *> names;
+            for (const mbedtls_x509_crt *crt = &chain; crt != NULL && crt->raw.p != NULL; crt = crt->next)
+            {
+                names.push_back(&crt->issuer_raw);
+            }
+
+            mbedtls_x509_crt *last = &issuers;
+            for (size_t n = 0; n < names.size(); ++n)
+            {
+                const mbedtls_x509_buf& name = *names[n];
+                for (const Entry *entry = FindFirst(name); entry != m_index + m_count && IsSubject(entry, name); ++entry)
+                {
+                    size_t i = entry - m_index;
+                    if (loaded[i])
+                    {
+                        continue;
+                    }
+                    loaded[i] = true;
+
+                    int res = mbedtls_x509_crt_parse_der(&issuers, m_data + entry->certOffset, entry->certLen);
+                    if (res != 0)
+                    {
+                        return res;
+                    }
+
+                    while (last->next != NULL)
+                    {
+                        last = last->next;
+                    }
+
+                    // A CA, which is not self-signed, needs its own issuer too
+                    if (Compare(last->issuer_raw.p, last->issuer_raw.len, last->subject_raw.p, last->subject_raw.len) != 0)
+                    {
+                        names.push_back(&last->issuer_raw);
+                    }
+                }
+            }
+            return 0;
+        }
+
+        int CaStore::Verify(mbedtls_x509_crt & chain, const std::string & hostname, const mbedtls_x509_crt_profile * profile,
+            uint32_t & flags) const
+        {
+            mbedtls_x509_crt issuers;
+            mbedtls_x509_crt_init(&issuers);
+
+            int res = LoadIssuers(chain, issuers);
+            if (res == 0)
+            {
+                res = mbedtls_x509_crt_verify_with_profile(&chain, &issuers, NULL, profile,
+                    hostname.empty() ? NULL : hostname.c_str(), &flags, NULL, NULL);
+            }
+
+            mbedtls_x509_crt_free(&issuers);
+            return res;
+        }
+
+        const CaStore & CaStore::GetDefault()
+        {
+            static const CaStore store(CACERT_DER_DATA, CACERT_DER_INDEX, sizeof(CACERT_DER_INDEX) / sizeof(CACERT_DER_INDEX[0]));
+            return store;
+        }
+
+        const CaStore::Entry * CaStore::FindFirst(const mbedtls_x509_buf & subject) const
+        {
+            const Entry *first = m_index;
+            size_t count = m_count;
+            while (count > 0)
+            {
+                size_t step = count / 2;
+                const Entry *middle = first + step;
+                if (Compare(m_data + middle->subjectOffset, middle->subjectLen, subject.p, subject.len) < 0)
+                {
+                    first = middle + 1;
+                    count -= step + 1;
+                }
+                else
+                {
+                    count = step;
+                }
+            }
+            return first;
+        }
+
+        bool CaStore::IsSubject(const Entry * entry, const mbedtls_x509_buf & subject) const
+        {
+            return Compare(m_data + entry->subjectOffset, entry->subjectLen, subject.p, subject.len) == 0;
         }
     }
 }
@@ -26,6 +26,8 @@
 #include "FP.h"
 #include "MQTTPacket.h"
 #include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
 #include "MQTTLogging.h"
 
 #if !defined(MQTTCLIENT_QOS1)
@@ -66,6 +68,17 @@ struct MessageData
 };
 
 
+struct PacketData
+{
+    PacketData(int aType, unsigned char* aBuf, int aBuflen) : type(aType), buf(aBuf), buflen(aBuflen)
+    { }
+
+    int type;
+    unsigned char* buf;
+    int buflen;
+};
+
+
 class PacketId
 {
 public:
@@ -101,6 +114,7 @@ class Client
 public:
 
     typedef FP<void, MessageData&> messageHandler;
+    typedef FP<void, PacketData&> packetHandler;
 
     /** Construct the client
      *  @param network - pointer to an instance of the Network class - must be connected to the endpoint
@@ -109,11 +123,23 @@ public:
      */
     Client(Network& network, unsigned int command_timeout_ms = 30000);
 
+    ~Client();
+
     void setCommandTimeout(unsigned long command_timeout_ms)
     {
         this->command_timeout_ms = command_timeout_ms;
     }
 
+    /** Set the maximum size of an incoming packet. Packets up to MAX_MQTT_PACKET_SIZE are read into the static
+     *  read buffer. Larger packets, up to max_packet_size, are read into a temporary heap buffer. Packets over the
+     *  limit are read off the network and dropped, and cycle returns BUFFER_OVERFLOW for them.
+     *  @param max_packet_size - the maximum incoming packet size
+     */
+    void setMaxPacketSize(int max_packet_size)
+    {
+        this->max_packet_size = max_packet_size;
+    }
+
     /** Set the default message handling callback - used for any message which does not match a subscription message handler
      *  @param mh - pointer to the callback function
      */
@@ -122,6 +148,23 @@ public:
         defaultMessageHandler = mh;
     }
 
+    /** Set the acknowledgement handling callback - invoked for every PUBACK, PUBREC, PUBCOMP and SUBACK packet
+     *  received, so that publishes and subscribes sent with sendPacket can be tracked outside of the client
+     *  @param ph - pointer to the callback function
+     */
+    void setAckHandler(packetHandler ph)
+    {
+        ackHandler = ph;
+    }
+
+    /** Get the next packet id to be used for a QoS 1 or QoS 2 packet
+     *  @return packet id
+     */
+    unsigned short getNextPacketId()
+    {
+        return (unsigned short)packetid.getNext();
+    }
+
     /** MQTT Connect - send an MQTT connect packet down the network and wait for a Connack
      *  The nework object must be connected to the network endpoint before calling this
      *  Default connect options are used
@@ -138,6 +181,21 @@ public:
 
     int connect(MQTTPacket_connectData& options, bool& sessionPresent);
 
+    /** MQTT Connect - send an MQTT connect packet down the network without waiting for the Connack, so that
+     *  other packets can be sent right behind it. Must be followed by waitForConnack
+     *  @param options - connect options
+     *  @param timer - the timer for the packet write to complete
+     *  @return success code -
+     */
+    int sendConnect(MQTTPacket_connectData& options, Timer& timer);
+
+    /** Wait for the Connack to a connect packet, sent with sendConnect
+     *  @param sessionPresent - set to the session present flag of the Connack
+     *  @param timer - the timer for the Connack to be received
+     *  @return success code -
+     */
+    int waitForConnack(bool& sessionPresent, Timer& timer);
+
     /** MQTT Publish - send an MQTT publish packet and wait for all acks to complete for all QoSs
      *  @param topic - the topic to publish to
      *  @param message - the message to send
@@ -193,6 +251,20 @@ public:
      */
     int yield(unsigned long timeout_ms = 1000L);
 
+    /** Get one piece of work off the wire and one pass through. Unlike yield, this returns after a single packet
+     *  @param timer the timer for the packet read to complete
+     *  @return the MQTT packet type read, or a negative failure code
+     */
+    int cycle(Timer& timer);
+
+    /** Send an already serialized MQTT packet down the network
+     *  @param buf - the packet data
+     *  @param length - the length of the packet data
+     *  @param timer the timer for the packet write to complete
+     *  @return success code -
+     */
+    int sendPacket(const unsigned char* buf, int length, Timer& timer);
+
     /** Is the client connected?
      *  @return flag - is the client connected or not?
      */
@@ -201,16 +273,51 @@ public:
         return isconnected;
     }
 
+    /** Send a PINGREQ if nothing has been sent or received for the keepalive interval
+     *  @return success code
+     */
+    int keepalive();
+
+    /** Get the time left until keepalive has to send a PINGREQ
+     *  @return the time in milliseconds, or -1 if no PINGREQ is due
+     */
+    int getKeepAliveLeftMs()
+    {
+        if (keepAliveInterval == 0 || ping_outstanding || !isconnected)
+            return -1;
+        int sentLeft = last_sent.left_ms();
+        int receivedLeft = last_received.left_ms();
+        return sentLeft < receivedLeft ? sentLeft : receivedLeft;
+    }
+
+#if MQTTCLIENT_QOS2
+    /** Get the number of incoming QoS 2 messages, which are delivered and wait for a PUBREL
+     *  @return number of incoming QoS 2 packet ids in use
+     */
+    int getIncomingQoS2Count() const
+    {
+        return incomingQoS2count;
+    }
+
+    /** Get the maximum number of incoming QoS 2 packet ids, which have been in use at the same time
+     *  @return maximum number of incoming QoS 2 packet ids in use
+     */
+    int getIncomingQoS2MaxCount() const
+    {
+        return incomingQoS2maxCount;
+    }
+#endif
+
 private:
 
 	void cleanSession();
-    int cycle(Timer& timer);
     int waitfor(int packet_type, Timer& timer);
-    int keepalive();
     int publish(int len, Timer& timer, enum QoS qos);
 
     int decodePacket(int* value, int timeout);
     int readPacket(Timer& timer);
+    int drainPacket(int len, Timer& timer);
+    void releaseReadBuffer();
     int sendPacket(int length, Timer& timer);
     int deliverMessage(MQTTString& topicName, Message& message);
     bool isTopicMatched(char* topicFilter, MQTTString& topicName);
@@ -219,7 +326,10 @@ private:
     unsigned long command_timeout_ms;
 
     unsigned char sendbuf[MAX_MQTT_PACKET_SIZE];
-    unsigned char readbuf[MAX_MQTT_PACKET_SIZE];
+    unsigned char staticreadbuf[MAX_MQTT_PACKET_SIZE];
+    unsigned char* readbuf;     // points to staticreadbuf, or to a heap buffer while a large packet is processed
+    int readbuflen;
+    int max_packet_size;
 
     Timer last_sent, last_received;
     unsigned int keepAliveInterval;
@@ -235,6 +345,7 @@ private:
     } messageHandlers[MAX_MESSAGE_HANDLERS + 1];      // Message handlers are indexed by subscription topic
 
     messageHandler defaultMessageHandler;
+    packetHandler ackHandler;
 
     bool isconnected;
 
@@ -247,13 +358,13 @@ private:
 
 #if MQTTCLIENT_QOS2
     bool pubrel;
-    #if !defined(MAX_INCOMING_QOS2_MESSAGES)
-        #define MAX_INCOMING_QOS2_MESSAGES 10
-    #endif
-    unsigned short incomingQoS2messages[MAX_INCOMING_QOS2_MESSAGES];
+    unsigned char incomingQoS2msgids[65536 / 8];  // bitmap of the ids of incoming QoS2 messages, waiting for a PUBREL
+    int incomingQoS2count;
+    int incomingQoS2maxCount;
     bool isQoS2msgidFree(unsigned short id);
-    bool useQoS2msgid(unsigned short id);
+    void useQoS2msgid(unsigned short id);
 	void freeQoS2msgid(unsigned short id);
+    void clearQoS2msgids();
 #endif
 
 };
@@ -276,8 +387,7 @@ void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::cleanSession()
 
 #if MQTTCLIENT_QOS2
     pubrel = false;
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
-        incomingQoS2messages[i] = 0;
+    clearQoS2msgids();
 #endif
 }
 
@@ -286,62 +396,88 @@ template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
 MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::Client(Network& network, unsigned int command_timeout_ms)  : ipstack(network), packetid()
 {
     this->command_timeout_ms = command_timeout_ms;
+    readbuf = staticreadbuf;
+    readbuflen = a;
+    max_packet_size = a;
+#if MQTTCLIENT_QOS2
+    incomingQoS2maxCount = 0;
+#endif
 	cleanSession();
 }
 
 
-#if MQTTCLIENT_QOS2
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
+MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::~Client()
+{
+    releaseReadBuffer();
+}
+
+
 template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::isQoS2msgidFree(unsigned short id)
+void MQTT::Client<Network, Timer, a, b>::releaseReadBuffer()
 {
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
+    if (readbuf != staticreadbuf)
     {
-        if (incomingQoS2messages[i] == id)
-            return false;
+        free(readbuf);
+        readbuf = staticreadbuf;
+        readbuflen = a;
     }
-    return true;
 }
 
 
+#if MQTTCLIENT_QOS2
 template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::useQoS2msgid(unsigned short id)
+bool MQTT::Client<Network, Timer, a, b>::isQoS2msgidFree(unsigned short id)
 {
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
-    {
-        if (incomingQoS2messages[i] == 0)
-        {
-            incomingQoS2messages[i] = id;
-            return true;
-        }
-    }
-    return false;
+    return (incomingQoS2msgids[id >> 3] & (1 << (id & 7))) == 0;
+}
+
+
+template<class Network, class Timer, int a, int b>
+void MQTT::Client<Network, Timer, a, b>::useQoS2msgid(unsigned short id)
+{
+    incomingQoS2msgids[id >> 3] |= (unsigned char)(1 << (id & 7));
+    if (++incomingQoS2count > incomingQoS2maxCount)
+        incomingQoS2maxCount = incomingQoS2count;
 }
 
 
 template<class Network, class Timer, int a, int b>
 void MQTT::Client<Network, Timer, a, b>::freeQoS2msgid(unsigned short id)
 {
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
+    if (!isQoS2msgidFree(id))
     {
-        if (incomingQoS2messages[i] == id)
-        {
-            incomingQoS2messages[i] = 0;
-            return;
-        }
+        incomingQoS2msgids[id >> 3] &= (unsigned char)~(1 << (id & 7));
+        --incomingQoS2count;
     }
 }
+
+
+template<class Network, class Timer, int a, int b>
+void MQTT::Client<Network, Timer, a, b>::clearQoS2msgids()
+{
+    memset(incomingQoS2msgids, 0, sizeof(incomingQoS2msgids));
+    incomingQoS2count = 0;
+}
 #endif
 
 
 template<class Network, class Timer, int a, int b>
 int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
+{
+    return sendPacket(sendbuf, length, timer);
+}
+
+
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::sendPacket(const unsigned char* buf, int length, Timer& timer)
 {
     int rc = FAILURE,
         sent = 0;
 
     while (sent < length && !timer.expired())
     {
-        rc = ipstack.write(&sendbuf[sent], length - sent, timer.left_ms());
+        rc = ipstack.write(&buf[sent], length - sent, timer.left_ms());
         if (rc < 0)  // there was an error writing the data
             break;
         sent += rc;
@@ -357,12 +493,26 @@ int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
         
 #if defined(MQTT_DEBUG)
     char printbuf[150];
-    DEBUG("Rc %d from sending packet %s\n", rc, MQTTFormat_toServerString(printbuf, sizeof(printbuf), sendbuf, length));
+    DEBUG("Rc %d from sending packet %s\n", rc, MQTTFormat_toServerString(printbuf, sizeof(printbuf), (unsigned char*)buf, length));
 #endif
     return rc;
 }
 
 
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::drainPacket(int len, Timer& timer)
+{
+    while (len > 0)
+    {
+        int chunk = (len < a) ? len : a;
+        if (ipstack.read(readbuf, chunk, timer.left_ms()) != chunk)
+            return FAILURE;
+        len -= chunk;
+    }
+    return SUCCESS;
+}
+
+
 template<class Network, class Timer, int a, int b>
 int MQTT::Client<Network, Timer, a, b>::decodePacket(int* value, int timeout)
 {
@@ -406,6 +556,9 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::readPacket(Timer& tim
     int len = 0;
     int rem_len = 0;
 
+    /* the heap buffer of the previous packet is no longer in use */
+    releaseReadBuffer();
+
     /* 1. read the header byte.  This has the packet type in it */
     if (ipstack.read(readbuf, 1, timer.left_ms()) != 1)
         goto exit;
@@ -417,8 +570,17 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::readPacket(Timer& tim
 
 	if (rem_len > (MAX_MQTT_PACKET_SIZE - len))
 	{
-		rc = BUFFER_OVERFLOW;
-		goto exit;
+        unsigned char* largebuf = 0;
+        if (rem_len > max_packet_size - len || (largebuf = (unsigned char*)malloc(len + rem_len)) == 0)
+        {
+            /* skip the packet, so that the next one can be read */
+            if (drainPacket(rem_len, timer) == SUCCESS)
+                rc = BUFFER_OVERFLOW;
+            goto exit;
+        }
+        memcpy(largebuf, readbuf, len);
+        readbuf = largebuf;
+        readbuflen = len + rem_len;
 	}
 
     /* 3. read the rest of the buffer using a callback to supply the rest of the data */
@@ -516,11 +678,13 @@ int MQTT::Client<Network, Timer, a, b>::yield(unsigned long timeout_ms)
     timer.countdown_ms(timeout_ms);
     while (!timer.expired())
     {
-        if (cycle(timer) < 0)
+        if ((rc = cycle(timer)) < 0)
         {
-            rc = FAILURE;
+            if (rc != BUFFER_OVERFLOW)
+                rc = FAILURE;
             break;
         }
+        rc = SUCCESS;
     }
 
     return rc;
@@ -545,8 +709,14 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
 			rc = packet_type;
 			break;
         case CONNACK:
-        case PUBACK:
+            break;
         case SUBACK:
+        case PUBACK:
+            if (ackHandler.attached())
+            {
+                PacketData pd(packet_type, readbuf, readbuflen);
+                ackHandler(pd);
+            }
             break;
         case PUBLISH:
 		{
@@ -554,7 +724,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
             Message msg;
             int intQoS;
             if (MQTTDeserialize_publish((unsigned char*)&msg.dup, &intQoS, (unsigned char*)&msg.retained, (unsigned short*)&msg.id, &topicName,
-                                 (unsigned char**)&msg.payload, &msg.payloadlen, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+                                 (unsigned char**)&msg.payload, &msg.payloadlen, readbuf, readbuflen) != 1)
                 goto exit;
             msg.qos = (enum QoS)intQoS;
 #if MQTTCLIENT_QOS2
@@ -564,10 +734,8 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
 #if MQTTCLIENT_QOS2
             else if (isQoS2msgidFree(msg.id))
             {
-                if (useQoS2msgid(msg.id))
-                    deliverMessage(topicName, msg);
-                else
-                    WARN("Maximum number of incoming QoS2 messages exceeded");
+                useQoS2msgid(msg.id);
+                deliverMessage(topicName, msg);
             }
 #endif
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
@@ -592,7 +760,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
 		case PUBREL:
             unsigned short mypacketid;
             unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, readbuflen) != 1)
                 rc = FAILURE;
             else if ((len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, 
 						(packet_type == PUBREC) ? PUBREL : PUBCOMP, 0, mypacketid)) <= 0)
@@ -603,9 +771,19 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
                 goto exit; // there was a problem
 			if (packet_type == PUBREL)
 				freeQoS2msgid(mypacketid);
+            else if (ackHandler.attached())
+            {
+                PacketData pd(packet_type, readbuf, readbuflen);
+                ackHandler(pd);
+            }
             break;
 			
         case PUBCOMP:
+            if (ackHandler.attached())
+            {
+                PacketData pd(packet_type, readbuf, readbuflen);
+                ackHandler(pd);
+            }
             break;
 #endif
         case PINGRESP:
@@ -668,6 +846,16 @@ template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
 int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_connectData& options, bool& sessionPresent)
 {
     Timer connect_timer(command_timeout_ms);
+    int rc = sendConnect(options, connect_timer);
+    if (rc == SUCCESS)
+        rc = waitForConnack(sessionPresent, connect_timer);
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::sendConnect(MQTTPacket_connectData& options, Timer& connect_timer)
+{
     int rc = FAILURE;
     int len = 0;
 
@@ -676,6 +864,10 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
 
     this->keepAliveInterval = options.keepAliveInterval;
     this->cleansession = options.cleansession;
+#if MQTTCLIENT_QOS2
+    if (this->cleansession)
+        clearQoS2msgids(); // the broker discards the incomplete QoS 2 flows as well
+#endif
     if ((len = MQTTSerialize_connect(sendbuf, MAX_MQTT_PACKET_SIZE, &options)) <= 0)
         goto exit;
     if ((rc = sendPacket(len, connect_timer)) != SUCCESS)  // send the connect packet
@@ -683,12 +875,27 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
 
     if (this->keepAliveInterval > 0)
         last_received.countdown(this->keepAliveInterval);
+
+exit:
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::waitForConnack(bool& sessionPresent, Timer& connect_timer)
+{
+    int rc = FAILURE;
+    int len = 0;
+
+    if (isconnected)
+        goto exit;
+
     // this will be a blocking call, wait for the connack
     if (waitfor(CONNACK, connect_timer) == CONNACK)
     {
         unsigned char connack_rc = 255;
         sessionPresent = false;
-        if (MQTTDeserialize_connack((unsigned char*)&sessionPresent, &connack_rc, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+        if (MQTTDeserialize_connack((unsigned char*)&sessionPresent, &connack_rc, readbuf, readbuflen) == 1)
             rc = connack_rc;
         else
             rc = FAILURE;
@@ -759,7 +966,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::su
     {
         int count = 0, grantedQoS = -1;
         unsigned short mypacketid;
-        if (MQTTDeserialize_suback(&mypacketid, 1, &count, &grantedQoS, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+        if (MQTTDeserialize_suback(&mypacketid, 1, &count, &grantedQoS, readbuf, readbuflen) == 1)
             rc = grantedQoS; // 0, 1, 2 or 0x80
         if (rc != 0x80)
         {
@@ -809,7 +1016,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::un
     if (waitfor(UNSUBACK, timer) == UNSUBACK)
     {
         unsigned short mypacketid;  // should be the same as the packetid above
-        if (MQTTDeserialize_unsuback(&mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+        if (MQTTDeserialize_unsuback(&mypacketid, readbuf, readbuflen) == 1)
 		{
             rc = 0;
 
@@ -849,7 +1056,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Time
         {
             unsigned short mypacketid;
             unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, readbuflen) != 1)
                 rc = FAILURE;
             else if (inflightMsgid == mypacketid)
                 inflightMsgid = 0;
@@ -864,7 +1071,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Time
         {
             unsigned short mypacketid;
             unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, readbuflen) != 1)
                 rc = FAILURE;
             else if (inflightMsgid == mypacketid)
                 inflightMsgid = 0;
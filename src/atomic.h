@@ -0,0 +1,67 @@
+#ifndef _IOT_ATOMIC_H_
+#define _IOT_ATOMIC_H_
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace iot
+{
+    // Sequentially consistent atomic operations on a long value, shared between threads
+
+    inline long AtomicLoad(const volatile long& value)
+    {
+#ifdef _WIN32
+        return InterlockedCompareExchange(const_cast<volatile long *>(&value), 0, 0);
+#else
+        return __atomic_load_n(&value, __ATOMIC_SEQ_CST);
+#endif
+    }
+
+    inline void AtomicStore(volatile long& value, long newValue)
+    {
+#ifdef _WIN32
+        InterlockedExchange(&value, newValue);
+#else
+        __atomic_store_n(&value, newValue, __ATOMIC_SEQ_CST);
+#endif
+    }
+
+    inline long AtomicExchange(volatile long& value, long newValue)
+    {
+#ifdef _WIN32
+        return InterlockedExchange(&value, newValue);
+#else
+        return __atomic_exchange_n(&value, newValue, __ATOMIC_SEQ_CST);
+#endif
+    }
+
+    // Returns the previous value
+    inline long AtomicAdd(volatile long& value, long delta)
+    {
+#ifdef _WIN32
+        return InterlockedExchangeAdd(&value, delta);
+#else
+        return __atomic_fetch_add(&value, delta, __ATOMIC_SEQ_CST);
+#endif
+    }
+
+    // If value is equal to expected, sets it to newValue and returns true. Else, sets expected to the current value
+    // and returns false.
+    inline bool AtomicCompareExchange(volatile long& value, long& expected, long newValue)
+    {
+#ifdef _WIN32
+        long current = InterlockedCompareExchange(&value, newValue, expected);
+        if (current == expected)
+        {
+            return true;
+        }
+        expected = current;
+        return false;
+#else
+        return __atomic_compare_exchange_n(&value, &expected, newValue, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+    }
+}
+
+#endif // _IOT_ATOMIC_H_
@@ -3,15 +3,29 @@
 #include "mpin_full.h"
 #include "exception.h"
 #include "utils.h"
+#include "topic_trie.h"
+#include "outbound_queue.h"
+#include "thread.h"
+#include "io_owner.h"
+#include "mpsc_queue.h"
+#include "atomic.h"
 #include <fmt/format.h>
 #include <set>
+#include <map>
+#include <deque>
+#include <algorithm>
 #include <cassert>
+#include <climits>
 
 namespace iot
 {
     namespace
     {
         const char DEFAULT_MQTT_TLS_PORT[] = "8443";
+        const unsigned long MAX_PSK_LIFETIME_SEC = 24 * 60 * 60;
+        const unsigned int DEFAULT_QUEUE_PUBLISH_WINDOW = 16;
+        // Maximum time for which the I/O thread waits for network events
+        const long IO_THREAD_IDLE_MILLISEC = 1000;
 
         class DefaultEventListener : public EventListener
         {
@@ -23,6 +37,7 @@ namespace iot
             virtual void OnError(const String& error) {}
             virtual void OnMessageArrived(const String& topic, const String& payload) {}
             virtual void OnPrivateMessageArrived(const String& userIdFrom, const String& payload) {}
+            virtual void OnPublishCompleted(unsigned short packetId, bool ok) {}
         } defaultEventListener;
 
         String GetPrivateMessageTopic(const String& userId)
@@ -42,6 +57,11 @@ namespace iot
         sokRecvKey = HexDecode(recvKeyHex);
     }
 
+    void Identity::SetPrecomputeData(const String & precomputeDataHex)
+    {
+        precomputeData = HexDecode(precomputeDataHex);
+    }
+
     String Identity::GetUserId() const
     {
         try
@@ -74,8 +94,16 @@ namespace iot
         return HexEncode(sokRecvKey);
     }
 
+    String Identity::GetPrecomputeDataHex() const
+    {
+        return HexEncode(precomputeData);
+    }
+
     Config::Config()
-        : mqttCommandTimeoutMillisec(0), useMqttQoS2(true), useMqttPersistentSession(true)
+        : mqttCommandTimeoutMillisec(0), useMqttQoS2(true), useMqttPersistentSession(true), mqttPublishWindow(0),
+        reconnectMinDelayMillisec(1000), reconnectMaxDelayMillisec(60000), mqttMaxIncomingPacketSize(64 * 1024), mqttMaxTopicsPerSubscribe(8), outboundQueueMaxSize(1024 * 1024),
+        outboundQueueDropOldest(false), useIoThread(false), ioThreadQueueSize(1024), sokKeyCacheSize(64), authPass1PoolSize(0), pskLifetimeSec(3600), useTlsSessionResumption(true),
+        tlsMaxFragmentLength(0)
     {
         ResetEventListener();
     }
@@ -95,16 +123,35 @@ namespace iot
         return *m_eventListener;
     }
 
+    Statistics::Statistics()
+        : sokKeyCacheHits(0), sokKeyCacheMisses(0), pskCacheHits(0), pskCacheMisses(0), pskCacheRejects(0),
+        authPass1PoolHits(0), authPass1PoolMisses(0), tlsHandshakes(0), tlsResumedHandshakes(0), tlsReads(0), tlsWrites(0),
+        tlsBufferBytes(0), messagesReceived(0),
+        incomingQoS2Pending(0), incomingQoS2PendingMax(0), outboundQueueLength(0), outboundQueueDropped(0),
+        ioQueueLength(0), ioQueueMaxLength(0), ioQueueRejected(0), ioQueueLatencyAvgMicrosec(0),
+        ioQueueLatencyMaxMicrosec(0), connectAuthMicrosec(0), connectSocketMicrosec(0), connectTlsHandshakeMicrosec(0),
+        connectMqttMicrosec(0), connectTotalMicrosec(0)
+    {
+    }
+
     class Client::Impl
     {
     public:
-        Impl() : m_authenticator(m_crypto), m_authenticated(false), m_state(NO_SESSION)
+        Impl() : m_authenticator(m_crypto), m_authenticated(false), m_pskReused(false), m_state(NO_SESSION),
+            m_connectStep(AUTHENTICATE), m_reconnectAttempts(0), m_privateMessageHandler(*this), m_socketOpener(m_client),
+            m_connectStartTime(0), m_authTime(0), m_ioThreadRunner(*this), m_ioOwner(NULL), m_ioOwnerRefs(0), m_ioThreadStop(0), m_ioThreadWaiting(0), m_ioConnected(0), m_ioQueueRejected(0), m_nextPublishId(0), m_ioLatencyTotal(0),
+            m_ioCommandCount(0)
         {
             MqttTlsClient::Handler handler;
             handler.attach(this, &Impl::OnMessageArrived);
             m_client.SetMessageHandler(handler);
         }
 
+        ~Impl()
+        {
+            StopIoThread();
+        }
+
         void Configure(const Config& conf)
         {
             m_conf = conf;
@@ -130,9 +177,27 @@ namespace iot
                 }
                 m_client.SetQoS(m_conf.useMqttQoS2 ? MQTT::QOS2 : MQTT::QOS1);
                 m_client.UsePersistentSession(m_conf.useMqttPersistentSession);
+                OpenOutboundQueue();
+                // Queued messages are always published asynchronously
+                m_client.SetPublishWindow(m_queue.IsOpen() && m_conf.mqttPublishWindow == 0 ?
+                    DEFAULT_QUEUE_PUBLISH_WINDOW : m_conf.mqttPublishWindow);
+                m_client.UseTlsSessionResumption(m_conf.useTlsSessionResumption);
+                m_client.SetTlsMaxFragmentLength(m_conf.tlsMaxFragmentLength);
+                m_client.SetMaxIncomingPacketSize(static_cast<int>(m_conf.mqttMaxIncomingPacketSize));
+                m_client.SetMaxTopicsPerSubscribe(m_conf.mqttMaxTopicsPerSubscribe);
+                m_crypto.SetSokKeyCacheSize(m_conf.sokKeyCacheSize);
+                m_authenticator.SetPass1PoolSize(m_conf.authPass1PoolSize);
 
                 m_state = INITIAL;
-                CheckState();
+                m_connectStep = AUTHENTICATE;
+                m_reconnectAttempts = 0;
+                Connect();
+                AtomicStore(m_ioConnected, m_state == CONNECTED ? 1 : 0);
+
+                if (m_conf.useIoThread && m_ioOwner == NULL)
+                {
+                    StartIoThread();
+                }
             }
         }
 
@@ -140,24 +205,132 @@ namespace iot
         {
             if (IsSessionStarted())
             {
+                StopIoThread();
+                m_socketOpener.Stop();
                 m_client.Disconnect();
+                AtomicStore(m_ioConnected, 0);
+                m_client.CancelPendingPublishes();
                 m_subscriptions.clear();
+                m_handlers.Clear();
+                m_authenticator.SetPass1PoolSize(0);
                 m_state = NO_SESSION;
+                DispatchCompletedPublishes();
             }
         }
 
         bool IsSessionStarted() const
         {
-            return m_state != NO_SESSION;
+            return m_ioThread.IsRunning() || m_state != NO_SESSION;
         }
 
         bool IsConnected()
         {
+            if (ShouldPostCommand())
+            {
+                return AtomicLoad(m_ioConnected) != 0;
+            }
             return m_client.IsConnected();
         }
 
         bool Subscribe(const String& topic)
         {
+            {
+                IoOwnerRef owner(*this);
+                if (owner.ShouldPostBlockingCommand())
+                {
+                    IoCommand command(IoCommand::SUBSCRIBE);
+                    command.topic = topic;
+                    return PostCommand(command, owner.Get());
+                }
+            }
+
+            if (!DoSubscribe(topic))
+            {
+                return false;
+            }
+
+            m_handlers.Remove(topic);
+            return true;
+        }
+
+        bool Subscribe(const String& topic, MessageHandler& handler)
+        {
+            {
+                IoOwnerRef owner(*this);
+                if (owner.ShouldPostBlockingCommand())
+                {
+                    IoCommand command(IoCommand::SUBSCRIBE_HANDLER);
+                    command.topic = topic;
+                    command.handler = &handler;
+                    return PostCommand(command, owner.Get());
+                }
+            }
+
+            // The handler is set before subscribing, as messages may arrive before the subscribe command returns
+            m_handlers.Insert(topic, &handler);
+            if (!DoSubscribe(topic))
+            {
+                m_handlers.Remove(topic);
+                return false;
+            }
+
+            return true;
+        }
+
+        bool Subscribe(const StringVector& topics)
+        {
+            {
+                IoOwnerRef owner(*this);
+                if (owner.ShouldPostBlockingCommand())
+                {
+                    IoCommand command(IoCommand::SUBSCRIBE_TOPICS);
+                    command.topics = topics;
+                    return PostCommand(command, owner.Get());
+                }
+            }
+
+            if (IsWaitingForConnection())
+            {
+                for (size_t i = 0; i < topics.size(); ++i)
+                {
+                    m_subscriptions.insert(topics[i]);
+                    m_handlers.Remove(topics[i]);
+                }
+                return true;
+            }
+
+            if (!CheckState())
+            {
+                return false;
+            }
+
+            std::vector<bool> granted;
+            bool ok = m_client.Subscribe(topics, granted);
+            for (size_t i = 0; i < topics.size(); ++i)
+            {
+                if (granted[i])
+                {
+                    m_subscriptions.insert(topics[i]);
+                    m_handlers.Remove(topics[i]);
+                }
+            }
+
+            if (!ok)
+            {
+                GetEventListener().OnError(m_client.GetLastError());
+                return false;
+            }
+            return true;
+        }
+
+        bool DoSubscribe(const String& topic)
+        {
+            if (IsWaitingForConnection())
+            {
+                m_subscriptions.insert(topic);
+                return true;
+            }
+
             if (!CheckState())
             {
                 return false;
@@ -175,6 +348,16 @@ namespace iot
 
         bool Unsubscribe(const String& topic)
         {
+            {
+                IoOwnerRef owner(*this);
+                if (owner.ShouldPostBlockingCommand())
+                {
+                    IoCommand command(IoCommand::UNSUBSCRIBE);
+                    command.topic = topic;
+                    return PostCommand(command, owner.Get());
+                }
+            }
+
             if (!CheckState())
             {
                 return false;
@@ -187,32 +370,101 @@ namespace iot
             }
 
             m_subscriptions.erase(topic);
+            m_handlers.Remove(topic);
             return true;
         }
 
         bool Publish(const String& topic, const String& payload)
         {
+            unsigned short packetId;
+            return Publish(topic, payload, packetId);
+        }
+
+        bool Publish(const String& topic, const String& payload, unsigned short& packetId)
+        {
+            {
+                IoOwnerRef owner(*this);
+                if (owner.ShouldPostBlockingCommand())
+                {
+                    // The MQTT packet id is assigned by the I/O thread, so the caller gets an id of its own, which is
+                    // passed to OnPublishCompleted instead. Completions of queued messages are not reported.
+                    packetId = m_queue.IsOpen() ? 0 : GetNextPublishId();
+                    IoCommand command(IoCommand::PUBLISH);
+                    command.topic = topic;
+                    command.payload = payload;
+                    command.publishId = packetId;
+                    return PostCommand(command, owner.Get());
+                }
+            }
+
+            packetId = 0;
+            unsigned short mqttPacketId = 0;
+            return DoPublish(topic, payload, packetId, mqttPacketId);
+        }
+
+        // The MQTT packet ids of the asynchronous publishes are translated to the ids of the client - assigned here,
+        // or when the command was posted - so the direct and the posted publishes report their completions with ids
+        // from one space. publishId is set to 0 if the completion is not reported.
+        bool DoPublish(const String& topic, const String& payload, unsigned short& publishId, unsigned short& packetId)
+        {
+            if (m_queue.IsOpen())
+            {
+                publishId = 0;
+                if (!m_queue.Push(topic, payload))
+                {
+                    GetEventListener().OnError(m_queue.GetLastError());
+                    return false;
+                }
+
+                DrainOutboundQueue();
+                return true;
+            }
+
             if (!CheckState())
             {
                 return false;
             }
 
-            if (!m_client.Publish(topic, payload))
+            if (!m_client.Publish(topic, payload, packetId))
             {
                 GetEventListener().OnError(m_client.GetLastError());
                 return false;
             }
 
+            if (packetId == 0)
+            {
+                publishId = 0;
+                return true;
+            }
+
+            if (publishId == 0)
+            {
+                publishId = GetNextPublishId();
+            }
+            m_publishIds[packetId] = publishId;
             return true;
         }
 
         bool ListenForPrivateMessages()
         {
-            return Subscribe(m_privateMessagesTopic);
+            return Subscribe(m_privateMessagesTopic, m_privateMessageHandler);
         }
 
         bool SendPrivateMessage(const String& userIdTo, const String& payload, bool encrypt)
         {
+            {
+                IoOwnerRef owner(*this);
+                if (owner.ShouldPostBlockingCommand())
+                {
+                    // The message is serialized by the I/O thread, which owns the SOK key cache
+                    IoCommand command(IoCommand::PRIVATE_MESSAGE);
+                    command.topic = userIdTo;
+                    command.payload = payload;
+                    command.encrypt = encrypt;
+                    return PostCommand(command, owner.Get());
+                }
+            }
+
             try
             {
                 return Publish(GetPrivateMessageTopic(userIdTo), SerializePrivateMessage(userIdTo, payload, encrypt));
@@ -226,220 +478,995 @@ namespace iot
 
         bool RunMessageLoop(unsigned long timeout)
         {
-            Timer timer(timeout);
-            if (!CheckState())
+            if (ShouldPostCommand())
             {
-                if (!timer.IsExpired())
-                {
-                    timeout = timer.GetLeftMilliseconds();
-                    Sleep(timeout);
-                }
-                return false;
+                // The messages are processed by the I/O thread
+                Sleep(timeout);
+                return IsConnected();
             }
 
-            if (!m_client.RunMessageLoop(timeout))
+            if (m_state == NO_SESSION)
             {
-                GetEventListener().OnError(m_client.GetLastError());
+                GetEventListener().OnError("No session started");
+                Sleep(timeout);
                 return false;
             }
 
-            return true;
+            return ProcessMessages(timeout);
         }
 
-        void OnMessageArrived(MQTT::MessageData& md)
+        int GetSocket()
         {
-            std::string topic(md.topicName.lenstring.data, md.topicName.lenstring.len);
-            std::string payload((char *)md.message.payload, md.message.payloadlen);
-            EventListener& el = GetEventListener();
-            if (topic == m_privateMessagesTopic)
+            return ShouldPostCommand() ? -1 : m_client.GetSocket();
+        }
+
+        unsigned int GetIOEvents()
+        {
+            if (ShouldPostCommand() || m_client.GetSocket() < 0)
             {
-                try
-                {
-                    PrivateMessage pm(*this, payload);
-                    el.OnPrivateMessageArrived(pm.userIdFrom, pm.payload);
-                }
-                catch (const Exception& e)
-                {
-                    el.OnError(fmt::sprintf("Failed to deserialize private message: %s. Received payload: %s", e.what(), payload));
-                }
+                return 0;
             }
-            else
+
+            unsigned int events = Client::IO_READ;
+            if (m_client.HasPendingWrite())
             {
-                el.OnMessageArrived(topic, payload);
+                events |= Client::IO_WRITE;
             }
+            return events;
         }
 
-    private:
-        EventListener& GetEventListener()
+        long GetIOTimeout()
         {
-            return m_conf.GetEventListener();
+            if (ShouldPostCommand() || m_state == NO_SESSION)
+            {
+                return -1;
+            }
+
+            if (m_state != CONNECTED)
+            {
+                return m_reconnectTimer.GetLeftMilliseconds();
+            }
+
+            // Data, which is already received and decrypted, is not reported by the socket
+            if (!m_client.IsConnected() || m_client.HasBufferedData() || m_client.HasPendingWrite())
+            {
+                return 0;
+            }
+            return m_client.GetKeepAliveLeftMilliseconds();
         }
 
-        bool CheckState()
+        bool ProcessIO()
         {
-            switch (m_state)
+            if (ShouldPostCommand())
+            {
+                GetEventListener().OnError("ProcessIO can not be used while the I/O thread is running");
+                return false;
+            }
+
+            if (m_state == NO_SESSION)
             {
-            case NO_SESSION:
                 GetEventListener().OnError("No session started");
                 return false;
-            case INITIAL:
-                if (!InitialConnect())
+            }
+
+            return ProcessAvailableIO();
+        }
+
+        void RunIoThread()
+        {
+            while (AtomicLoad(m_ioThreadStop) == 0)
+            {
+                ProcessCommands();
+                WaitForIO();
+                if (AtomicLoad(m_ioThreadStop) != 0)
                 {
-                    GetEventListener().OnError(GetLastError());
-                    return false;
+                    break;
                 }
-                m_state = CONNECTED;
-                GetEventListener().OnConnected();
-                return true;
-            case CONNECTED:
-            case DISCONNECTED:
-                if (!IsConnected())
-                {
-                    if (m_state == CONNECTED)
-                    {
-                        m_state = DISCONNECTED;
-                        GetEventListener().OnConnectionLost(GetLastError());
-                    }
 
-                    if (!Reconnect())
-                    {
-                        GetEventListener().OnError(GetLastError());
-                    }
-                    else
-                    {
-                        m_state = CONNECTED;
-                        GetEventListener().OnConnected();
-                    }
-                }
-                return m_state == CONNECTED;
-            default:
-                assert(false);
-                GetEventListener().OnError(fmt::sprintf("Invalid client state: %d", m_state));
-                return false;
+                ProcessAvailableIO();
             }
+
+            // The commands, posted before the session was ended, are still executed
+            ProcessCommands();
         }
 
-        bool Authenticate()
+        void SetIoOwner(IoOwner *owner)
         {
-            if (m_authenticated)
+            if (owner != NULL)
             {
-                return true;
+                m_commands.Init(std::max(m_conf.ioThreadQueueSize, 1u));
+                AtomicStore(m_ioConnected, m_state == CONNECTED && m_client.IsConnected() ? 1 : 0);
             }
 
-            try
+            if (m_ioOwner != NULL)
             {
-                m_lastError.clear();
-                AuthResult authResult = m_authenticator.Authenticate(m_conf.authServerUrl, m_conf.identity);
-                if (authResult.identityChanged)
+                // Waits for the threads, which are posting a command to the current owner
+                AtomicAdd(m_ioOwnerRefs, -1);
+                while (AtomicLoad(m_ioOwnerRefs) != 0)
                 {
-                    m_conf.identity = authResult.newIdentity;
-                    GetEventListener().OnIdentityChanged(authResult.newIdentity);
+                    Sleep(0);
                 }
-
-                m_client.SetPsk(authResult.sharedSecret, HexEncode(authResult.clientId));
-                GetEventListener().OnAuthenticated();
-                return true;
             }
-            catch (const Exception& e)
+
+            m_ioOwner = owner;
+            if (owner != NULL)
             {
-                m_lastError = fmt::sprintf("Authentication failed: %s", e.what());
-                return false;
+                AtomicAdd(m_ioOwnerRefs, 1);
             }
         }
 
-        bool InitialConnect()
+        bool HasCommands() const
         {
-            if (Authenticate() && m_client.Connect())
-            {
-                return true;
-            }
-            return false;
+            return !m_commands.IsEmpty();
         }
 
-        bool Reconnect()
+        void ProcessCommands()
         {
-            if (Authenticate() && m_client.Reconnect())
+            m_stats.ioQueueMaxLength = std::max(m_stats.ioQueueMaxLength, static_cast<unsigned long>(m_commands.GetLength()));
+
+            // At most one queue length of commands is executed at once, so that the incoming messages are not delayed
+            // by a continuous stream of commands
+            for (size_t i = 0; i < m_commands.GetCapacity() && m_commands.Pop(m_command); ++i)
             {
-                if (!m_client.IsSessionPresent())
-                {
-                    return RestoreSubscriptions();
-                }
-                return true;
+                long long latency = std::max(GetTimeMicroseconds() - m_command.enqueueTime, 0LL);
+                m_ioLatencyTotal += latency;
+                ++m_ioCommandCount;
+                m_stats.ioQueueLatencyMaxMicrosec = std::max(m_stats.ioQueueLatencyMaxMicrosec, static_cast<unsigned long>(latency));
+                ExecuteCommand(m_command);
             }
-            return false;
         }
 
-        bool RestoreSubscriptions()
+        void OnMessageArrived(MQTT::MessageData& md)
         {
-            for (std::set<String>::iterator s = m_subscriptions.begin(); s != m_subscriptions.end(); ++s)
+            ++m_stats.messagesReceived;
+            std::string topic(md.topicName.lenstring.data, md.topicName.lenstring.len);
+            std::string payload((char *)md.message.payload, md.message.payloadlen);
+
+            // A handler may call a blocking method, which delivers the next message, so the matches are not shared
+            // between the deliveries
+            TopicTrie::Handlers matchedHandlers;
+            m_handlers.Match(md.topicName.lenstring.data, md.topicName.lenstring.len, matchedHandlers);
+            if (matchedHandlers.empty())
             {
-                if (!m_client.Subscribe(*s))
-                {
-                    GetEventListener().OnError(m_client.GetLastError());
-                    return false;
-                }
+                GetEventListener().OnMessageArrived(topic, payload);
+                return;
+            }
+
+            for (TopicTrie::Handlers::const_iterator h = matchedHandlers.begin(); h != matchedHandlers.end(); ++h)
+            {
+                (*h)->OnMessageArrived(topic, payload);
             }
-            return true;
         }
 
-        String SerializePrivateMessage(const String& userIdTo, const String& payload, bool encrypt)
+        void OnPrivateMessageArrived(const String& payload)
         {
-            json::Object json;
-            json["from"] = json::String(m_userId);
-            json["encrypted"] = json::Boolean(encrypt);
-            if (encrypt)
+            EventListener& el = GetEventListener();
+            try
             {
-                SokData sok = m_crypto.SokEncrypt(payload, m_conf.identity.sokSendKey, m_userId, userIdTo);
-                json["iv"] = json::String(HexEncode(sok.iv));
-                json["ciphertext"] = json::String(HexEncode(sok.ciphertext));
-                json["tag"] = json::String(HexEncode(sok.tag));
+                PrivateMessage pm(*this, payload);
+                el.OnPrivateMessageArrived(pm.userIdFrom, pm.payload);
             }
-            else
+            catch (const Exception& e)
             {
-                json["data"] = json::String(payload);
+                el.OnError(fmt::sprintf("Failed to deserialize private message: %s. Received payload: %s", e.what(), payload));
             }
-            return json::ToString(json);
         }
 
-        class PrivateMessage
+        Statistics GetStatistics() const
+        {
+            Statistics stats;
+            stats.sokKeyCacheHits = m_crypto.GetSokKeyCacheHits();
+            stats.sokKeyCacheMisses = m_crypto.GetSokKeyCacheMisses();
+            stats.pskCacheHits = m_stats.pskCacheHits;
+            stats.pskCacheMisses = m_stats.pskCacheMisses;
+            stats.pskCacheRejects = m_stats.pskCacheRejects;
+            stats.authPass1PoolHits = m_authenticator.GetPass1PoolHits();
+            stats.authPass1PoolMisses = m_authenticator.GetPass1PoolMisses();
+            stats.tlsHandshakes = m_client.GetTlsHandshakeCount();
+            stats.tlsResumedHandshakes = m_client.GetTlsResumedHandshakeCount();
+            stats.tlsReads = m_client.GetTlsReadCount();
+            stats.tlsWrites = m_client.GetTlsWriteCount();
+            stats.tlsBufferBytes = static_cast<unsigned long>(m_client.GetTlsBufferSize());
+            stats.messagesReceived = m_stats.messagesReceived;
+            stats.incomingQoS2Pending = m_client.GetIncomingQoS2Count();
+            stats.incomingQoS2PendingMax = m_client.GetIncomingQoS2MaxCount();
+            stats.outboundQueueLength = m_queue.GetLength();
+            stats.outboundQueueDropped = m_queue.GetDroppedCount();
+            stats.ioQueueLength = static_cast<unsigned long>(m_commands.GetLength());
+            stats.ioQueueMaxLength = m_stats.ioQueueMaxLength;
+            stats.ioQueueRejected = static_cast<unsigned long>(AtomicLoad(m_ioQueueRejected));
+            stats.ioQueueLatencyAvgMicrosec = m_ioCommandCount > 0 ?
+                static_cast<unsigned long>(m_ioLatencyTotal / m_ioCommandCount) : 0;
+            stats.ioQueueLatencyMaxMicrosec = m_stats.ioQueueLatencyMaxMicrosec;
+            stats.connectAuthMicrosec = m_stats.connectAuthMicrosec;
+            stats.connectSocketMicrosec = m_stats.connectSocketMicrosec;
+            stats.connectTlsHandshakeMicrosec = m_stats.connectTlsHandshakeMicrosec;
+            stats.connectMqttMicrosec = m_stats.connectMqttMicrosec;
+            stats.connectTotalMicrosec = m_stats.connectTotalMicrosec;
+            return stats;
+        }
+
+    private:
+        class IoCommand
         {
         public:
-            PrivateMessage(Impl& client, const String& serializedData)
-            {
-                try
-                {
-                    json::ConstElement json = json::Parse(serializedData);
-                    userIdFrom = (const json::String&) json["from"];
-                    bool encrypted = ((const json::Boolean&) json["encrypted"]).Value();
-                    if (encrypted)
-                    {
-                        SokData sok;
-                        sok.iv = HexDecode((const json::String&) json["iv"]);
-                        sok.ciphertext = HexDecode((const json::String&) json["ciphertext"]);
-                        sok.tag = HexDecode((const json::String&) json["tag"]);
-                        payload = client.m_crypto.SokDecrypt(sok, client.m_conf.identity.sokRecvKey, userIdFrom);
+            enum Type { PUBLISH, PRIVATE_MESSAGE, SUBSCRIBE, SUBSCRIBE_HANDLER, SUBSCRIBE_TOPICS, UNSUBSCRIBE };
 
-                        if (sok.iv.empty() || sok.ciphertext.empty() || sok.tag.empty())
-                        {
-                            throw JsonError(fmt::sprintf("Invalid private message parameters in message %s", serializedData));
-                        }
-                    }
-                    else
-                    {
-                        payload = (const json::String&) json["data"];
-                    }
-                }
-                catch (const json::Exception& e)
-                {
-                    throw JsonError(e.what());
-                }
+            IoCommand() : type(PUBLISH), handler(NULL), encrypt(false), publishId(0), enqueueTime(0) {}
+            IoCommand(Type _type) : type(_type), handler(NULL), encrypt(false), publishId(0), enqueueTime(0) {}
+
+            void Swap(IoCommand& other)
+            {
+                std::swap(type, other.type);
+                topic.swap(other.topic);
+                payload.swap(other.payload);
+                topics.swap(other.topics);
+                std::swap(handler, other.handler);
+                std::swap(encrypt, other.encrypt);
+                std::swap(publishId, other.publishId);
+                std::swap(enqueueTime, other.enqueueTime);
             }
 
-            String userIdFrom;
+            Type type;
+            String topic;
             String payload;
+            StringVector topics;
+            MessageHandler *handler;
+            bool encrypt;
+            unsigned short publishId;
+            long long enqueueTime;
         };
 
-        const String& GetLastError() const
+        EventListener& GetEventListener()
+        {
+            return m_conf.GetEventListener();
+        }
+
+        bool ProcessMessages(unsigned long timeout)
+        {
+            Timer timer(static_cast<int>(timeout));
+            bool ok = false;
+            do
+            {
+                if (m_state == CONNECTED && !IsConnected())
+                {
+                    OnConnectionLost();
+                }
+
+                if (m_state != CONNECTED)
+                {
+                    if (m_reconnectTimer.IsExpired())
+                    {
+                        ConnectStep();
+                    }
+                    else
+                    {
+                        Sleep(std::min(timer.GetLeftMilliseconds(), m_reconnectTimer.GetLeftMilliseconds()));
+                    }
+                    continue;
+                }
+
+                ok = m_client.RunMessageLoop(timer.GetLeftMilliseconds());
+                if (!ok)
+                {
+                    GetEventListener().OnError(m_client.GetLastError());
+                }
+
+                DispatchCompletedPublishes();
+                DrainOutboundQueue();
+            } while (!timer.IsExpired());
+            return ok && m_state == CONNECTED;
+        }
+
+        bool ProcessAvailableIO()
+        {
+            if (m_state == CONNECTED && !IsConnected())
+            {
+                OnConnectionLost();
+            }
+
+            if (m_state != CONNECTED)
+            {
+                // Connecting takes several round trips, so a thread, shared with other clients, leaves it to its owner
+                if (m_reconnectTimer.IsExpired() && MayBlock())
+                {
+                    ConnectStep();
+                }
+                AtomicStore(m_ioConnected, m_state == CONNECTED ? 1 : 0);
+                return m_state == CONNECTED;
+            }
+
+            bool ok = m_client.ProcessIO();
+            if (!ok)
+            {
+                GetEventListener().OnError(m_client.GetLastError());
+            }
+
+            DispatchCompletedPublishes();
+            DrainOutboundQueue();
+            AtomicStore(m_ioConnected, m_state == CONNECTED && m_client.IsConnected() ? 1 : 0);
+            return ok && m_state == CONNECTED;
+        }
+
+        bool ShouldPostCommand()
+        {
+            IoOwnerRef owner(*this);
+            return owner.ShouldPostCommand();
+        }
+
+        bool MayBlock()
+        {
+            IoOwnerRef owner(*this);
+            return owner.MayBlock();
+        }
+
+        // Called from any thread. Returns the owner, which is not released until ReleaseIoOwner is called, or NULL.
+        IoOwner *AcquireIoOwner()
+        {
+            // Bit 0 is set while there is an owner, the rest counts the references
+            if ((AtomicAdd(m_ioOwnerRefs, 2) & 1) == 0)
+            {
+                AtomicAdd(m_ioOwnerRefs, -2);
+                return NULL;
+            }
+            return m_ioOwner;
+        }
+
+        void ReleaseIoOwner()
+        {
+            AtomicAdd(m_ioOwnerRefs, -2);
+        }
+
+        void StartIoThread()
+        {
+            AtomicStore(m_ioThreadStop, 0);
+            AtomicStore(m_ioThreadWaiting, 0);
+            if (!m_ioWakeup.Open())
+            {
+                GetEventListener().OnError(m_ioWakeup.GetLastError());
+                return;
+            }
+
+            SetIoOwner(&m_ioThreadRunner);
+            if (!m_ioThread.Start(m_ioThreadRunner))
+            {
+                SetIoOwner(NULL);
+                m_ioWakeup.Close();
+                GetEventListener().OnError("Failed to start the I/O thread");
+                // The commands, which may have been posted meanwhile
+                ProcessCommands();
+            }
+        }
+
+        void StopIoThread()
+        {
+            if (!m_ioThread.IsRunning())
+            {
+                return;
+            }
+
+            AtomicStore(m_ioThreadStop, 1);
+            m_ioWakeup.Signal();
+            m_ioThread.Join();
+            SetIoOwner(NULL);
+            m_ioWakeup.Close();
+
+            // The commands, posted before the owner was released, but after the last ones the I/O thread executed
+            ProcessCommands();
+        }
+
+        // The owner is kept by the caller with an IoOwnerRef
+        bool PostCommand(IoCommand& command, IoOwner *owner)
+        {
+            command.enqueueTime = GetTimeMicroseconds();
+            if (!m_commands.Push(command))
+            {
+                AtomicAdd(m_ioQueueRejected, 1);
+                GetEventListener().OnError("I/O thread queue is full");
+                return false;
+            }
+
+            owner->OnCommandPosted();
+            return true;
+        }
+
+        void WakeIoThread()
+        {
+            // The I/O thread is woken up only if it is waiting, so a burst of commands costs a single system call
+            if (AtomicExchange(m_ioThreadWaiting, 0) != 0)
+            {
+                m_ioWakeup.Signal();
+            }
+        }
+
+
+        void ExecuteCommand(const IoCommand& command)
+        {
+            switch (command.type)
+            {
+            case IoCommand::PUBLISH:
+                ExecutePublish(command);
+                break;
+            case IoCommand::PRIVATE_MESSAGE:
+                SendPrivateMessage(command.topic, command.payload, command.encrypt);
+                break;
+            case IoCommand::SUBSCRIBE:
+                Subscribe(command.topic);
+                break;
+            case IoCommand::SUBSCRIBE_HANDLER:
+                Subscribe(command.topic, *command.handler);
+                break;
+            case IoCommand::SUBSCRIBE_TOPICS:
+                Subscribe(command.topics);
+                break;
+            case IoCommand::UNSUBSCRIBE:
+                Unsubscribe(command.topic);
+                break;
+            default:
+                assert(false);
+            }
+        }
+
+        void ExecutePublish(const IoCommand& command)
+        {
+            unsigned short publishId = command.publishId;
+            unsigned short packetId = 0;
+            bool ok = DoPublish(command.topic, command.payload, publishId, packetId);
+            if (command.publishId == 0 || (ok && packetId != 0))
+            {
+                // Completed asynchronously, if at all - the id is translated when the acknowledgement arrives
+                return;
+            }
+            GetEventListener().OnPublishCompleted(command.publishId, ok);
+        }
+
+        // Called from any thread, which publishes
+        unsigned short GetNextPublishId()
+        {
+            unsigned short id = 0;
+            while (id == 0)
+            {
+                id = static_cast<unsigned short>(AtomicAdd(m_nextPublishId, 1) + 1);
+            }
+            return id;
+        }
+
+        void WaitForIO()
+        {
+            // Waits for incoming data, a posted command, a keepalive or the time for the next reconnect attempt
+            long timeout = GetIOTimeout();
+            if (timeout < 0 || timeout > IO_THREAD_IDLE_MILLISEC)
+            {
+                timeout = IO_THREAD_IDLE_MILLISEC;
+            }
+
+            if (timeout == 0)
+            {
+                return;
+            }
+
+            AtomicStore(m_ioThreadWaiting, 1);
+            if (m_commands.IsEmpty())
+            {
+                m_ioWakeup.Wait(m_client.GetSocket(), static_cast<unsigned long>(timeout));
+            }
+            AtomicStore(m_ioThreadWaiting, 0);
+        }
+
+        void DispatchCompletedPublishes()
+        {
+            MqttTlsClient::PublishResult result(0, false);
+            while (m_client.GetCompletedPublish(result))
+            {
+                if (CompleteQueuedPublish(result))
+                {
+                    continue;
+                }
+
+                std::map<unsigned short, unsigned short>::iterator id = m_publishIds.find(result.packetId);
+                if (id != m_publishIds.end())
+                {
+                    unsigned short publishId = id->second;
+                    m_publishIds.erase(id);
+                    GetEventListener().OnPublishCompleted(publishId, result.ok);
+                }
+            }
+        }
+
+        void OpenOutboundQueue()
+        {
+            m_queue.Close();
+            if (!m_conf.outboundQueueFile.empty() &&
+                !m_queue.Open(m_conf.outboundQueueFile, m_conf.outboundQueueMaxSize, m_conf.outboundQueueDropOldest))
+            {
+                GetEventListener().OnError(m_queue.GetLastError());
+            }
+        }
+
+        void DrainOutboundQueue()
+        {
+            while (m_state == CONNECTED && !m_client.IsPublishWindowFull() && m_queue.Peek(m_queuedMessage))
+            {
+                unsigned short packetId;
+                if (!m_client.Publish(m_queuedMessage.topic, m_queuedMessage.payload, packetId))
+                {
+                    // The connection is lost - the message is sent after reconnecting
+                    return;
+                }
+
+                m_queue.Next();
+                m_queueInFlight.push_back(QueuedPublish(packetId, m_queuedMessage.seq));
+            }
+        }
+
+        bool CompleteQueuedPublish(const MqttTlsClient::PublishResult& result)
+        {
+            std::deque<QueuedPublish>::iterator p = m_queueInFlight.begin();
+            while (p != m_queueInFlight.end() && p->packetId != result.packetId)
+            {
+                ++p;
+            }
+
+            if (p == m_queueInFlight.end())
+            {
+                return false;
+            }
+
+            if (!result.ok)
+            {
+                // The session has ended - the message stays in the queue for the next session
+                m_queueInFlight.erase(p);
+                m_queue.Rewind();
+                return true;
+            }
+
+            // Messages are removed from the queue in order, as the acknowledgements may arrive out of order
+            p->completed = true;
+            while (!m_queueInFlight.empty() && m_queueInFlight.front().completed)
+            {
+                m_queue.Pop(m_queueInFlight.front().seq);
+                m_queueInFlight.pop_front();
+            }
+            return true;
+        }
+
+        bool CheckState()
+        {
+            switch (m_state)
+            {
+            case NO_SESSION:
+                GetEventListener().OnError("No session started");
+                return false;
+            case CONNECTED:
+                if (IsConnected())
+                {
+                    return true;
+                }
+                OnConnectionLost();
+                // Fall through
+            case INITIAL:
+            case DISCONNECTED:
+                // The connection is reestablished by RunMessageLoop
+                GetEventListener().OnError("Not connected to the MQTT broker");
+                return false;
+            default:
+                assert(false);
+                GetEventListener().OnError(fmt::sprintf("Invalid client state: %d", m_state));
+                return false;
+            }
+        }
+
+        // While the session waits for the connection to be reestablished, the subscriptions are only recorded and
+        // are sent once it is connected
+        bool IsWaitingForConnection()
+        {
+            if (m_state == CONNECTED && !IsConnected())
+            {
+                OnConnectionLost();
+            }
+            return m_state == INITIAL || m_state == DISCONNECTED;
+        }
+
+        bool CanReusePsk() const
+        {
+            return m_authenticated && !m_pskTimer.IsExpired() &&
+                m_pskMpinId == m_conf.identity.mpinId && m_pskAuthServerUrl == m_conf.authServerUrl;
+        }
+
+        // Runs the M-Pin authentication only - the result is applied by OnAuthenticated, after the socket opener has
+        // finished, so the user callbacks never run concurrently with it
+        bool Authenticate(AuthResult& authResult)
+        {
+            m_pskReused = false;
+            m_authTime = 0;
+            if (CanReusePsk())
+            {
+                ++m_stats.pskCacheHits;
+                m_pskReused = true;
+                return true;
+            }
+
+            try
+            {
+                m_authenticated = false;
+                m_lastError.clear();
+                ++m_stats.pskCacheMisses;
+                long long start = GetTimeMicroseconds();
+                authResult = m_authenticator.Authenticate(m_conf.authServerUrl, m_conf.identity);
+                m_authTime = GetTimeMicroseconds() - start;
+                return true;
+            }
+            catch (const Exception& e)
+            {
+                m_lastError = fmt::sprintf("Authentication failed: %s", e.what());
+                return false;
+            }
+        }
+
+        void OnAuthenticated(const AuthResult& authResult)
+        {
+            m_conf.identity.precomputeData = authResult.precomputeData;
+            if (authResult.identityChanged)
+            {
+                m_authenticator.ClearPrecomputeCache();
+                m_conf.identity = authResult.newIdentity;
+                GetEventListener().OnIdentityChanged(authResult.newIdentity);
+            }
+
+            m_client.SetPsk(authResult.sharedSecret, HexEncode(authResult.clientId));
+            if (m_conf.pskLifetimeSec > 0)
+            {
+                m_authenticated = true;
+                m_pskTimer.StartCountdown(static_cast<int>(std::min(m_conf.pskLifetimeSec, MAX_PSK_LIFETIME_SEC)));
+                m_pskMpinId = m_conf.identity.mpinId;
+                m_pskAuthServerUrl = m_conf.authServerUrl;
+            }
+            GetEventListener().OnAuthenticated();
+        }
+
+        bool Connect()
+        {
+            unsigned int attempts = m_reconnectAttempts;
+            while (m_state != CONNECTED && m_state != NO_SESSION && m_reconnectAttempts == attempts)
+            {
+                ConnectStep();
+            }
+            return m_state == CONNECTED;
+        }
+
+        void ConnectStep()
+        {
+            if (m_connectStep == AUTHENTICATE)
+            {
+                m_connectStartTime = GetTimeMicroseconds();
+                // The broker connection does not depend on the PSK, so its address is resolved and the TCP connection
+                // is opened on another thread, while the authentication round trips are running
+                bool openingSocket = !CanReusePsk() && m_socketOpener.Start();
+                AuthResult authResult;
+                bool authenticated = Authenticate(authResult);
+                if (openingSocket)
+                {
+                    m_socketOpener.Wait();
+                }
+
+                if (!authenticated)
+                {
+                    m_client.CloseSocket();
+                    OnConnectFailed();
+                    return;
+                }
+
+                m_connectStep = CONNECT;
+                if (!m_pskReused)
+                {
+                    OnAuthenticated(authResult);
+                    // Authentication has taken a few round trips - connect on the next step
+                    return;
+                }
+            }
+
+            StringVector subscriptions(m_subscriptions.begin(), m_subscriptions.end());
+            bool connected = m_state == INITIAL ? m_client.Connect(subscriptions) : m_client.Reconnect(subscriptions);
+            if (!connected)
+            {
+                if (m_pskReused && m_client.IsHandshakeFailed())
+                {
+                    // The broker has rejected the cached PSK - get a fresh one without waiting
+                    ++m_stats.pskCacheRejects;
+                    m_authenticated = false;
+                    m_connectStep = AUTHENTICATE;
+                    return;
+                }
+
+                if (!m_pskReused && m_client.IsHandshakeFailed())
+                {
+                    // A fresh PSK is rejected if it was derived from stale or corrupt precomputation data, loaded with
+                    // the identity - the next authentication recomputes it
+                    m_authenticator.ClearPrecomputeCache();
+                    m_conf.identity.precomputeData.clear();
+                }
+
+                OnConnectFailed();
+                return;
+            }
+
+            m_state = CONNECTED;
+            m_connectStep = AUTHENTICATE;
+            m_reconnectAttempts = 0;
+            m_stats.connectAuthMicrosec = static_cast<unsigned long>(m_authTime);
+            m_stats.connectSocketMicrosec = m_client.GetSocketOpenMicrosec();
+            m_stats.connectTlsHandshakeMicrosec = m_client.GetTlsHandshakeMicrosec();
+            m_stats.connectMqttMicrosec = m_client.GetMqttConnectMicrosec();
+            m_stats.connectTotalMicrosec = static_cast<unsigned long>(GetTimeMicroseconds() - m_connectStartTime);
+            GetEventListener().OnConnected();
+            DrainOutboundQueue();
+        }
+
+        void OnConnectFailed()
+        {
+            GetEventListener().OnError(GetLastError());
+            m_connectStep = AUTHENTICATE;
+            ++m_reconnectAttempts;
+            m_reconnectTimer.StartCountdownMs(GetReconnectDelay());
+        }
+
+        void OnConnectionLost()
+        {
+            m_state = DISCONNECTED;
+            GetEventListener().OnConnectionLost(GetLastError());
+            m_connectStep = AUTHENTICATE;
+            m_reconnectAttempts = 0;
+            m_reconnectTimer.StartCountdownMs(GetReconnectDelay());
+        }
+
+        int GetReconnectDelay()
+        {
+            // Exponential backoff with full jitter, so that clients, disconnected at the same time, do not reconnect
+            // at the same time. The doubling starts from at least 1 ms, so that a zero minimum delay still backs off.
+            unsigned long minDelay = std::max(m_conf.reconnectMinDelayMillisec, 1ul);
+            unsigned long maxDelay = std::min(minDelay, m_conf.reconnectMaxDelayMillisec);
+            for (unsigned int i = 0; i < m_reconnectAttempts && maxDelay < m_conf.reconnectMaxDelayMillisec; ++i)
+            {
+                maxDelay = std::min(maxDelay * 2, m_conf.reconnectMaxDelayMillisec);
+            }
+            return static_cast<int>(m_crypto.GenerateRandomNumber() % (maxDelay + 1));
+        }
+
+        String SerializePrivateMessage(const String& userIdTo, const String& payload, bool encrypt)
+        {
+            json::Object json;
+            json["from"] = json::String(m_userId);
+            json["encrypted"] = json::Boolean(encrypt);
+            if (encrypt)
+            {
+                SokData sok = m_crypto.SokEncrypt(payload, m_conf.identity.sokSendKey, m_userId, userIdTo);
+                json["iv"] = json::String(HexEncode(sok.iv));
+                json["ciphertext"] = json::String(HexEncode(sok.ciphertext));
+                json["tag"] = json::String(HexEncode(sok.tag));
+            }
+            else
+            {
+                json["data"] = json::String(payload);
+            }
+            return json::ToString(json);
+        }
+
+        class QueuedPublish
+        {
+        public:
+            QueuedPublish(unsigned short _packetId, uint64_t _seq) : packetId(_packetId), seq(_seq), completed(false) {}
+
+            unsigned short packetId;
+            uint64_t seq;
+            bool completed;
+        };
+
+        class IoThreadRunner : public Runnable, public IoOwner
+        {
+        public:
+            IoThreadRunner(Impl& client) : m_client(client) {}
+
+            virtual void Run()
+            {
+                m_client.RunIoThread();
+            }
+
+            virtual bool IsCurrentThread() const
+            {
+                return m_client.m_ioThread.IsCurrent();
+            }
+
+            virtual void OnCommandPosted()
+            {
+                m_client.WakeIoThread();
+            }
+
+            virtual bool MayBlock() const
+            {
+                return true;
+            }
+
+        private:
+            Impl& m_client;
+        };
+
+        // Keeps the I/O owner of the client from being released, while a command is posted to it. A session manager
+        // deletes its session right after releasing it.
+        class IoOwnerRef
+        {
+        public:
+            IoOwnerRef(Impl& client) : m_client(client), m_owner(client.AcquireIoOwner()) {}
+
+            ~IoOwnerRef()
+            {
+                if (m_owner != NULL)
+                {
+                    m_client.ReleaseIoOwner();
+                }
+            }
+
+            IoOwner *Get() const
+            {
+                return m_owner;
+            }
+
+            // While the connection is owned by an I/O thread, the commands from the application threads are passed
+            // to it, while the owner itself (for example, in an event listener callback) executes them directly
+            bool ShouldPostCommand() const
+            {
+                return m_owner != NULL && !m_owner->IsCurrentThread();
+            }
+
+            // The commands, which wait for the broker, are posted also from an owner thread, which is shared with
+            // other clients (a session manager worker calling an event listener)
+            bool ShouldPostBlockingCommand() const
+            {
+                return m_owner != NULL && (!m_owner->IsCurrentThread() || !m_owner->MayBlock());
+            }
+
+            bool MayBlock() const
+            {
+                return m_owner == NULL || m_owner->MayBlock();
+            }
+
+        private:
+            Impl& m_client;
+            IoOwner *m_owner;
+        };
+
+        // Opens the broker socket on a helper thread, which is started with the first request and is kept until the
+        // session ends
+        class SocketOpener : public Runnable
+        {
+        public:
+            SocketOpener(MqttTlsClient& client) : m_client(client), m_stop(0), m_requested(0), m_busy(0) {}
+
+            ~SocketOpener()
+            {
+                Stop();
+            }
+
+            bool Start()
+            {
+                if (!m_thread.IsRunning())
+                {
+                    AtomicStore(m_stop, 0);
+                    if (!m_request.Open() || !m_done.Open() || !m_thread.Start(*this))
+                    {
+                        m_request.Close();
+                        m_done.Close();
+                        return false;
+                    }
+                }
+
+                AtomicStore(m_busy, 1);
+                AtomicStore(m_requested, 1);
+                m_request.Signal();
+                return true;
+            }
+
+            void Wait()
+            {
+                while (AtomicLoad(m_busy) != 0)
+                {
+                    m_done.Wait(-1, ULONG_MAX);
+                }
+            }
+
+            void Stop()
+            {
+                if (!m_thread.IsRunning())
+                {
+                    return;
+                }
+
+                AtomicStore(m_stop, 1);
+                m_request.Signal();
+                m_thread.Join();
+                m_request.Close();
+                m_done.Close();
+            }
+
+            virtual void Run()
+            {
+                while (AtomicLoad(m_stop) == 0)
+                {
+                    if (AtomicExchange(m_requested, 0) == 0)
+                    {
+                        m_request.Wait(-1, ULONG_MAX);
+                        continue;
+                    }
+
+                    // A failure is reported by the connect step, which tries to open the socket again
+                    m_client.OpenSocket();
+                    AtomicStore(m_busy, 0);
+                    m_done.Signal();
+                }
+            }
+
+        private:
+            MqttTlsClient& m_client;
+            Thread m_thread;
+            WakeupEvent m_request;
+            WakeupEvent m_done;
+            volatile long m_stop;
+            volatile long m_requested;
+            volatile long m_busy;
+        };
+
+        class PrivateMessageHandler : public MessageHandler
+        {
+        public:
+            PrivateMessageHandler(Impl& client) : m_client(client) {}
+
+            virtual void OnMessageArrived(const String& topic, const String& payload)
+            {
+                m_client.OnPrivateMessageArrived(payload);
+            }
+
+        private:
+            Impl& m_client;
+        };
+
+        class PrivateMessage
+        {
+        public:
+            PrivateMessage(Impl& client, const String& serializedData)
+            {
+                try
+                {
+                    json::ConstElement json = json::Parse(serializedData);
+                    userIdFrom = (const json::String&) json["from"];
+                    bool encrypted = ((const json::Boolean&) json["encrypted"]).Value();
+                    if (encrypted)
+                    {
+                        SokData sok;
+                        sok.iv = HexDecode((const json::String&) json["iv"]);
+                        sok.ciphertext = HexDecode((const json::String&) json["ciphertext"]);
+                        sok.tag = HexDecode((const json::String&) json["tag"]);
+                        payload = client.m_crypto.SokDecrypt(sok, client.m_conf.identity.sokRecvKey, userIdFrom);
+
+                        if (sok.iv.empty() || sok.ciphertext.empty() || sok.tag.empty())
+                        {
+                            throw JsonError(fmt::sprintf("Invalid private message parameters in message %s", serializedData));
+                        }
+                    }
+                    else
+                    {
+                        payload = (const json::String&) json["data"];
+                    }
+                }
+                catch (const json::Exception& e)
+                {
+                    throw JsonError(e.what());
+                }
+            }
+
+            String userIdFrom;
+            String payload;
+        };
+
+        const String& GetLastError() const
         {
             return m_lastError.empty() ? m_client.GetLastError() : m_lastError;
         }
@@ -448,9 +1475,40 @@ namespace iot
         Crypto m_crypto;
         MPinFull m_authenticator;
         bool m_authenticated;
+        bool m_pskReused;
+        Timer m_pskTimer;
+        String m_pskMpinId;
+        String m_pskAuthServerUrl;
+        Statistics m_stats;
         MqttTlsClient m_client;
         enum State { NO_SESSION, INITIAL, CONNECTED, DISCONNECTED } m_state;
+        enum ConnectStep { AUTHENTICATE, CONNECT } m_connectStep;
+        unsigned int m_reconnectAttempts;
+        Timer m_reconnectTimer;
         std::set<String> m_subscriptions;
+        TopicTrie m_handlers;
+        PrivateMessageHandler m_privateMessageHandler;
+        SocketOpener m_socketOpener;
+        long long m_connectStartTime;
+        long long m_authTime;
+        OutboundQueue m_queue;
+        OutboundQueue::Message m_queuedMessage;
+        std::deque<QueuedPublish> m_queueInFlight;
+        Thread m_ioThread;
+        IoThreadRunner m_ioThreadRunner;
+        IoOwner *m_ioOwner;
+        volatile long m_ioOwnerRefs;
+        WakeupEvent m_ioWakeup;
+        MpscQueue<IoCommand> m_commands;
+        IoCommand m_command;
+        volatile long m_ioThreadStop;
+        volatile long m_ioThreadWaiting;
+        volatile long m_ioConnected;
+        volatile long m_ioQueueRejected;
+        volatile long m_nextPublishId;
+        std::map<unsigned short, unsigned short> m_publishIds;
+        unsigned long long m_ioLatencyTotal;
+        unsigned long m_ioCommandCount;
         String m_userId;
         String m_privateMessagesTopic;
         String m_lastError;
@@ -498,6 +1556,16 @@ namespace iot
         return m_impl->Subscribe(topic);
     }
 
+    bool Client::Subscribe(const StringVector & topics)
+    {
+        return m_impl->Subscribe(topics);
+    }
+
+    bool Client::Subscribe(const String & topic, MessageHandler & handler)
+    {
+        return m_impl->Subscribe(topic, handler);
+    }
+
     bool Client::Unsubscribe(const String & topic)
     {
         return m_impl->Unsubscribe(topic);
@@ -508,6 +1576,11 @@ namespace iot
         return m_impl->Publish(topic, payload);
     }
 
+    bool Client::Publish(const String & topic, const String & payload, unsigned short & packetId)
+    {
+        return m_impl->Publish(topic, payload, packetId);
+    }
+
     bool Client::ListenForPrivateMessages()
     {
         return m_impl->ListenForPrivateMessages();
@@ -522,4 +1595,44 @@ namespace iot
     {
         return m_impl->RunMessageLoop(timeout);
     }
+
+    int Client::GetSocket()
+    {
+        return m_impl->GetSocket();
+    }
+
+    unsigned int Client::GetIOEvents()
+    {
+        return m_impl->GetIOEvents();
+    }
+
+    long Client::GetIOTimeout()
+    {
+        return m_impl->GetIOTimeout();
+    }
+
+    bool Client::ProcessIO()
+    {
+        return m_impl->ProcessIO();
+    }
+
+    Statistics Client::GetStatistics() const
+    {
+        return m_impl->GetStatistics();
+    }
+
+    void Client::SetIoOwner(IoOwner * owner)
+    {
+        m_impl->SetIoOwner(owner);
+    }
+
+    void Client::ProcessCommands()
+    {
+        m_impl->ProcessCommands();
+    }
+
+    bool Client::HasCommands() const
+    {
+        return m_impl->HasCommands();
+    }
 }
@@ -95,11 +95,102 @@ namespace iot
 
     PrecomputeData::PrecomputeData(const std::string & _g1, const std::string & _g2) : g1(_g1), g2(_g2) {}
 
+    SokKeyCache::SokKeyCache() : m_capacity(0), m_hits(0), m_misses(0) {}
+
+    void SokKeyCache::SetCapacity(size_t capacity)
+    {
+        m_capacity = capacity;
+        while (m_entries.size() > m_capacity)
+        {
+            m_index.erase(m_entries.back().first);
+            m_entries.pop_back();
+        }
+    }
+
+    bool SokKeyCache::Get(const std::string & ownKey, const std::string & peerId, std::string & keyOut)
+    {
+        if (ownKey != m_ownKey)
+        {
+            Clear();
+            m_ownKey = ownKey;
+        }
+
+        Index::iterator i = m_index.find(peerId);
+        if (i == m_index.end())
+        {
+            ++m_misses;
+            return false;
+        }
+
+        m_entries.splice(m_entries.begin(), m_entries, i->second);
+        keyOut = i->second->second;
+        ++m_hits;
+        return true;
+    }
+
+    void SokKeyCache::Put(const std::string & ownKey, const std::string & peerId, const std::string & key)
+    {
+        if (m_capacity == 0 || ownKey != m_ownKey)
+        {
+            return;
+        }
+
+        Index::iterator i = m_index.find(peerId);
+        if (i != m_index.end())
+        {
+            i->second->second = key;
+            m_entries.splice(m_entries.begin(), m_entries, i->second);
+            return;
+        }
+
+        if (m_entries.size() >= m_capacity)
+        {
+            m_index.erase(m_entries.back().first);
+            m_entries.pop_back();
+        }
+
+        m_entries.push_front(std::make_pair(peerId, key));
+        m_index[peerId] = m_entries.begin();
+    }
+
+    void SokKeyCache::Clear()
+    {
+        m_entries.clear();
+        m_index.clear();
+        m_ownKey.clear();
+    }
+
+    unsigned long SokKeyCache::GetHits() const
+    {
+        return m_hits;
+    }
+
+    unsigned long SokKeyCache::GetMisses() const
+    {
+        return m_misses;
+    }
+
     Crypto::Crypto() : m_rngCreated(false)
     {
         memset(&m_rng, 0, sizeof(m_rng));
     }
 
+    void Crypto::SetSokKeyCacheSize(size_t size)
+    {
+        m_sokSendKeys.SetCapacity(size);
+        m_sokRecvKeys.SetCapacity(size);
+    }
+
+    unsigned long Crypto::GetSokKeyCacheHits() const
+    {
+        return m_sokSendKeys.GetHits() + m_sokRecvKeys.GetHits();
+    }
+
+    unsigned long Crypto::GetSokKeyCacheMisses() const
+    {
+        return m_sokSendKeys.GetMisses() + m_sokRecvKeys.GetMisses();
+    }
+
     Crypto::~Crypto()
     {
         if (m_rngCreated)
@@ -120,6 +211,17 @@ namespace iot
         }
     }
 
+    unsigned long Crypto::GenerateRandomNumber()
+    {
+        CreateRngOnce();
+        unsigned long res = 0;
+        for (size_t i = 0; i < sizeof(res); ++i)
+        {
+            res = (res << 8) | static_cast<unsigned char>(RAND_byte(&m_rng));
+        }
+        return res;
+    }
+
     std::string Crypto::HashId(const std::string & id)
     {
         Octet oid(id);
@@ -215,6 +317,18 @@ namespace iot
         return PrecomputeData(g1, g2);
     }
 
+    bool Crypto::ParsePrecomputeData(const std::string & data, PrecomputeData & precomp)
+    {
+        if (data.size() != 2 * GTS)
+        {
+            return false;
+        }
+
+        precomp.g1 = data.substr(0, GTS);
+        precomp.g2 = data.substr(GTS);
+        return true;
+    }
+
     std::string Crypto::SharedKey(const Pass1Data & pass1, const Pass2Data & pass2, const AuthData & auth)
     {
         Octet g1(auth.precomp.g1);
@@ -263,16 +377,24 @@ namespace iot
                 static_cast<int>(sokSendKey.size()), static_cast<int>(G1S)));
         }
 
-        Octet aKeyG1(sokSendKey);
-        Octet idTo(userIdTo);
-        Octet encryptionKey(PAS);
-
-        int res = SOK_PAIR1(HASH_TYPE_MPIN, 0, &aKeyG1, NULL, &idTo, &encryptionKey);
-        if (res)
+        std::string key;
+        if (!m_sokSendKeys.Get(sokSendKey, userIdTo, key))
         {
-            throw CryptoError("SOK_PAIR1", res);
+            Octet aKeyG1(sokSendKey);
+            Octet idTo(userIdTo);
+            Octet pairKey(PAS);
+
+            int res = SOK_PAIR1(HASH_TYPE_MPIN, 0, &aKeyG1, NULL, &idTo, &pairKey);
+            if (res)
+            {
+                throw CryptoError("SOK_PAIR1", res);
+            }
+
+            key = pairKey;
+            m_sokSendKeys.Put(sokSendKey, userIdTo, key);
         }
 
+        Octet encryptionKey(key);
         Octet iv(PIV);
         FillWithRandomData(iv, m_rng);
 
@@ -294,16 +416,25 @@ namespace iot
                 static_cast<int>(sokRecvKey.size()), static_cast<int>(G2S)));
         }
 
-        Octet bKeyG2(sokRecvKey);
-        Octet idFrom(userIdFrom);
-        Octet decriptionKey(PAS);
-
-        int res = SOK_PAIR2(HASH_TYPE_MPIN, 0, &bKeyG2, NULL, &idFrom, &decriptionKey);
-        if (res)
+        std::string key;
+        if (!m_sokRecvKeys.Get(sokRecvKey, userIdFrom, key))
         {
-            throw CryptoError("SOK_PAIR2", res);
+            Octet bKeyG2(sokRecvKey);
+            Octet idFrom(userIdFrom);
+            Octet pairKey(PAS);
+
+            int res = SOK_PAIR2(HASH_TYPE_MPIN, 0, &bKeyG2, NULL, &idFrom, &pairKey);
+            if (res)
+            {
+                throw CryptoError("SOK_PAIR2", res);
+            }
+
+            key = pairKey;
+            m_sokRecvKeys.Put(sokRecvKey, userIdFrom, key);
         }
 
+        Octet decriptionKey(key);
+        Octet idFrom(userIdFrom);
         Octet iv(data.iv);
         Octet ciphertext(data.ciphertext);
         Octet plaintext(data.ciphertext.size());
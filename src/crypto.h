@@ -8,6 +8,9 @@ extern "C"
 #include <randapi.h>
 }
 #include <string>
+#include <list>
+#include <map>
+#include <utility>
 
 namespace iot
 {
@@ -58,17 +61,45 @@ namespace iot
         std::string tag;
     };
 
+    class SokKeyCache
+    {
+    public:
+        SokKeyCache();
+        void SetCapacity(size_t capacity);
+        bool Get(const std::string& ownKey, const std::string& peerId, std::string& keyOut);
+        void Put(const std::string& ownKey, const std::string& peerId, const std::string& key);
+        void Clear();
+        unsigned long GetHits() const;
+        unsigned long GetMisses() const;
+
+    private:
+        typedef std::list<std::pair<std::string, std::string> > Entries;
+        typedef std::map<std::string, Entries::iterator> Index;
+
+        Entries m_entries;
+        Index m_index;
+        std::string m_ownKey;
+        size_t m_capacity;
+        unsigned long m_hits;
+        unsigned long m_misses;
+    };
+
     class Crypto
     {
     public:
         Crypto();
         ~Crypto();
+        void SetSokKeyCacheSize(size_t size);
+        unsigned long GetSokKeyCacheHits() const;
+        unsigned long GetSokKeyCacheMisses() const;
+        unsigned long GenerateRandomNumber();
         std::string HashId(const std::string& id);
         Pass1Data Client1(const std::string& mpinId, const std::string& clientSecret);
         std::string Client2(const std::string& x, const std::string& y, const std::string& sec);
         std::string GetG1Multiple(const std::string& hashId, std::string& rOut);
         std::string HashAll(const std::string& hashId, const Pass1Data& pass1, const Pass2Data& pass2, const std::string& t);
         PrecomputeData Precompute(const std::string& token, const std::string& hashId);
+        bool ParsePrecomputeData(const std::string& data, PrecomputeData& precomp);
         std::string SharedKey(const Pass1Data& pass1, const Pass2Data& pass2, const AuthData& auth);
         std::string RecombineClientSecret(const std::string& share1, const std::string& share2);
         SokData SokEncrypt(const std::string& message, const std::string& sokSendKey, const std::string& userIdFrom, const std::string& userIdTo);
@@ -79,6 +110,8 @@ namespace iot
 
         csprng m_rng;
         bool m_rngCreated;
+        SokKeyCache m_sokSendKeys;
+        SokKeyCache m_sokRecvKeys;
     };
 }
 
@@ -0,0 +1,23 @@
+#ifndef _IOT_IO_OWNER_H_
+#define _IOT_IO_OWNER_H_
+
+namespace iot
+{
+    // Runs the network I/O of a client in a thread, which is not the application thread - either the own I/O thread
+    // of the client, or a worker thread of a SessionManager. The commands from the other threads are posted to the
+    // client command queue and are executed by the owner.
+    class IoOwner
+    {
+    public:
+        virtual ~IoOwner() {}
+        // Tells whether the client may be used directly from the calling thread
+        virtual bool IsCurrentThread() const = 0;
+        // Called from the thread, which posted a command, after it is pushed to the queue
+        virtual void OnCommandPosted() = 0;
+        // Tells whether the calling thread may wait for the network, for example, for a publish acknowledgement, or
+        // is shared with other clients
+        virtual bool MayBlock() const = 0;
+    };
+}
+
+#endif // _IOT_IO_OWNER_H_
@@ -1,14 +1,353 @@
 #include "utils.h"
 #include "exception.h"
+#include "thread.h"
+#include "timer.h"
 #include <fmt/format.h>
 #include <sstream>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <climits>
 #include "mpin_full.h"
 
 namespace iot
 {
+    namespace
+    {
+        // The pools are refilled after the connection is established, so the refill does not compete with it
+        const long long PASS1_REFILL_DELAY_MICROSEC = 2000000;
+    }
+
     AuthResult::AuthResult() : identityChanged(false) {}
 
-    MPinFull::MPinFull(Crypto & crypto) : m_crypto(crypto) {}
+    // Computes the M-Pin precomputation data (two pairings) on a worker thread. It depends only on the identity, so
+    // it runs while the authentication requests are in flight.
+    class MPinFull::PrecomputeTask : public Runnable
+    {
+    public:
+        PrecomputeTask(Crypto& crypto) : m_crypto(crypto), m_started(false) {}
+
+        // The thread writes the result members, which are destroyed before it
+        ~PrecomputeTask()
+        {
+            m_thread.Join();
+        }
+
+        void Start(const std::string& clientSecret, const std::string& hashId)
+        {
+            m_clientSecret = clientSecret;
+            m_hashId = hashId;
+            m_started = true;
+            if (!m_thread.Start(*this))
+            {
+                Run();
+            }
+        }
+
+        bool IsStarted() const
+        {
+            return m_started;
+        }
+
+        bool Wait()
+        {
+            m_thread.Join();
+            return m_error.empty();
+        }
+
+        const PrecomputeData& GetResult() const
+        {
+            return m_result;
+        }
+
+        const std::string& GetError() const
+        {
+            return m_error;
+        }
+
+        virtual void Run()
+        {
+            try
+            {
+                m_result = m_crypto.Precompute(m_clientSecret, m_hashId);
+            }
+            catch (const Exception& e)
+            {
+                m_error = e.what();
+            }
+        }
+
+    private:
+        Crypto& m_crypto;
+        Thread m_thread;
+        bool m_started;
+        std::string m_clientSecret;
+        std::string m_hashId;
+        PrecomputeData m_result;
+        std::string m_error;
+    };
+
+    // Keeps pools of single-use pass 1 values - the random x with its two G1 multiples and the random r with its G1
+    // multiple - so that the authentication on reconnect does not wait for these point multiplications. One worker
+    // thread with its own random generator serves the pools of all clients in the process. It is created with the
+    // first pool and released with the last one.
+    class MPinFull::Pass1Precomputer : public Runnable
+    {
+    public:
+        static Pass1Precomputer *Acquire()
+        {
+            MutexLock lock(s_mutex);
+            if (s_instance == NULL)
+            {
+                s_instance = new Pass1Precomputer();
+            }
+            ++s_instance->m_refCount;
+            return s_instance;
+        }
+
+        static void Release()
+        {
+            MutexLock lock(s_mutex);
+            if (s_instance != NULL && --s_instance->m_refCount == 0)
+            {
+                delete s_instance;
+                s_instance = NULL;
+            }
+        }
+
+        void SetPoolSize(const MPinFull *owner, size_t poolSize)
+        {
+            MutexLock lock(m_mutex);
+            Pools::iterator i = m_pools.find(owner);
+            if (i == m_pools.end())
+            {
+                i = m_pools.insert(std::make_pair(owner, Pool())).first;
+                i->second.generation = ++m_generation;
+            }
+            i->second.poolSize = poolSize;
+            while (i->second.values.size() > poolSize)
+            {
+                i->second.values.pop_back();
+            }
+        }
+
+        void Remove(const MPinFull *owner)
+        {
+            MutexLock lock(m_mutex);
+            m_pools.erase(owner);
+        }
+
+        void Clear(const MPinFull *owner)
+        {
+            MutexLock lock(m_mutex);
+            Pools::iterator i = m_pools.find(owner);
+            if (i != m_pools.end())
+            {
+                Reset(i->second, "", "", "");
+            }
+        }
+
+        // Takes a set of values for the identity, if there is one. The pool is switched to the identity and is
+        // refilled after a delay.
+        bool Take(const MPinFull *owner, const std::string& mpinId, const std::string& clientSecret,
+            const std::string& hashId, Pass1Data& pass1, Pass2Data& pass2)
+        {
+            MutexLock lock(m_mutex);
+            Pools::iterator i = m_pools.find(owner);
+            if (i == m_pools.end())
+            {
+                return false;
+            }
+
+            Pool& pool = i->second;
+            if (pool.mpinId != mpinId || pool.clientSecret != clientSecret)
+            {
+                Reset(pool, mpinId, clientSecret, hashId);
+            }
+
+            bool found = !pool.values.empty();
+            if (found)
+            {
+                const Values& values = pool.values.front();
+                pass1 = values.pass1;
+                pass2.z = values.z;
+                pass2.r = values.r;
+                pool.values.pop_front();
+            }
+
+            pool.refillTime = GetTimeMicroseconds() + PASS1_REFILL_DELAY_MICROSEC;
+            m_wakeup.Signal();
+            return found;
+        }
+
+        virtual void Run()
+        {
+            for (;;)
+            {
+                const MPinFull *owner = NULL;
+                unsigned int generation = 0;
+                std::string mpinId;
+                std::string clientSecret;
+                std::string hashId;
+                unsigned long waitMillisec = ULONG_MAX;
+                {
+                    MutexLock lock(m_mutex);
+                    if (m_stop)
+                    {
+                        return;
+                    }
+
+                    long long now = GetTimeMicroseconds();
+                    for (Pools::const_iterator i = m_pools.begin(); i != m_pools.end() && owner == NULL; ++i)
+                    {
+                        const Pool& pool = i->second;
+                        if (pool.mpinId.empty() || pool.failed || pool.values.size() >= pool.poolSize)
+                        {
+                            continue;
+                        }
+
+                        if (pool.refillTime > now)
+                        {
+                            waitMillisec = std::min(waitMillisec, static_cast<unsigned long>((pool.refillTime - now) / 1000 + 1));
+                            continue;
+                        }
+
+                        owner = i->first;
+                        generation = pool.generation;
+                        mpinId = pool.mpinId;
+                        clientSecret = pool.clientSecret;
+                        hashId = pool.hashId;
+                    }
+                }
+
+                if (owner == NULL)
+                {
+                    m_wakeup.Wait(-1, waitMillisec);
+                    continue;
+                }
+
+                Compute(owner, generation, mpinId, clientSecret, hashId);
+            }
+        }
+
+    private:
+        class Values
+        {
+        public:
+            Values(const Pass1Data& _pass1, const std::string& _z, const std::string& _r) :
+                pass1(_pass1), z(_z), r(_r) {}
+
+            Pass1Data pass1;
+            std::string z;
+            std::string r;
+        };
+
+        class Pool
+        {
+        public:
+            Pool() : poolSize(0), generation(0), refillTime(0), failed(false) {}
+
+            std::string mpinId;
+            std::string clientSecret;
+            std::string hashId;
+            std::deque<Values> values;
+            size_t poolSize;
+            unsigned int generation;
+            long long refillTime;
+            bool failed;
+        };
+
+        typedef std::map<const MPinFull *, Pool> Pools;
+
+        Pass1Precomputer() : m_generation(0), m_stop(false), m_refCount(0)
+        {
+            if (m_wakeup.Open())
+            {
+                m_thread.Start(*this);
+            }
+        }
+
+        ~Pass1Precomputer()
+        {
+            {
+                MutexLock lock(m_mutex);
+                m_stop = true;
+            }
+            m_wakeup.Signal();
+            m_thread.Join();
+        }
+
+        void Reset(Pool& pool, const std::string& mpinId, const std::string& clientSecret, const std::string& hashId)
+        {
+            pool.mpinId = mpinId;
+            pool.clientSecret = clientSecret;
+            pool.hashId = hashId;
+            pool.values.clear();
+            pool.generation = ++m_generation;
+            pool.failed = false;
+        }
+
+        void Compute(const MPinFull *owner, unsigned int generation, const std::string& mpinId,
+            const std::string& clientSecret, const std::string& hashId)
+        {
+            bool failed = false;
+            Pass1Data pass1("", "", "", "");
+            std::string z;
+            std::string r;
+            try
+            {
+                pass1 = m_crypto.Client1(mpinId, clientSecret);
+                z = m_crypto.GetG1Multiple(hashId, r);
+            }
+            catch (const Exception&)
+            {
+                // The pool stays empty until it is switched to another identity
+                failed = true;
+            }
+
+            MutexLock lock(m_mutex);
+            Pools::iterator i = m_pools.find(owner);
+            if (i == m_pools.end() || i->second.generation != generation)
+            {
+                return;
+            }
+
+            Pool& pool = i->second;
+            if (failed)
+            {
+                pool.failed = true;
+            }
+            else if (pool.values.size() < pool.poolSize)
+            {
+                pool.values.push_back(Values(pass1, z, r));
+            }
+        }
+
+        Crypto m_crypto;
+        Mutex m_mutex;
+        WakeupEvent m_wakeup;
+        Thread m_thread;
+        Pools m_pools;
+        unsigned int m_generation;
+        bool m_stop;
+        unsigned int m_refCount;
+
+        static Mutex s_mutex;
+        static Pass1Precomputer *s_instance;
+    };
+
+    Mutex MPinFull::Pass1Precomputer::s_mutex;
+    MPinFull::Pass1Precomputer *MPinFull::Pass1Precomputer::s_instance = NULL;
+
+    MPinFull::MPinFull(Crypto & crypto) : m_crypto(crypto), m_pass1Precomputer(NULL), m_pass1PoolHits(0),
+        m_pass1PoolMisses(0)
+    {
+    }
+
+    MPinFull::~MPinFull()
+    {
+        SetPass1PoolSize(0);
+    }
 
     AuthResult MPinFull::Authenticate(const std::string& server, const Identity & id)
     {
@@ -29,39 +368,61 @@ namespace iot
         json::ConstElement response;
         std::string mpinIdHex = HexEncode(id.mpinId);
 
-        res.clientId = m_crypto.HashId(id.mpinId);
-        Pass1Data pass1 = m_crypto.Client1(id.mpinId, id.clientSecret);
+        PrecomputeTask precompute(m_crypto);
+        StartPrecompute(id, precompute);
 
-        request["dta"] = json::ToArray(id.dtaList.begin(), id.dtaList.end());
-        request["mpin_id"] = json::String(mpinIdHex);
-        request["U"] = json::String(HexEncode(pass1.u));
-        request["UT"] = json::String(HexEncode(pass1.ut));
+        res.clientId = m_cachedHashId;
+        Pass1Data pass1("", "", "", "");
+        Pass2Data pass2;
+        if (!TakePrecomputedPass1(id, pass1, pass2))
+        {
+            pass1 = m_crypto.Client1(id.mpinId, id.clientSecret);
+            pass2.z = m_crypto.GetG1Multiple(res.clientId, pass2.r);
+        }
 
-        response = m_httpClient.MakePostRequest(fmt::sprintf("%s/auth/pass1", server), request);
+        try
+        {
+            request["dta"] = json::ToArray(id.dtaList.begin(), id.dtaList.end());
+            request["mpin_id"] = json::String(mpinIdHex);
+            request["U"] = json::String(HexEncode(pass1.u));
+            request["UT"] = json::String(HexEncode(pass1.ut));
 
-        Pass2Data pass2;
-        pass2.y = HexDecode((const json::String&) response["y"]);
-        pass2.v = m_crypto.Client2(pass1.x, pass2.y, pass1.sec);
-        pass2.z = m_crypto.GetG1Multiple(res.clientId, pass2.r);
+            response = m_httpClient.MakePostRequest(fmt::sprintf("%s/auth/pass1", server), request);
 
-        request.Clear();
-        request["mpin_id"] = json::String(mpinIdHex);
-        request["WID"] = json::String("");
-        request["OTP"] = json::Boolean(false);
-        request["V"] = json::String(HexEncode(pass2.v));
-        request["Z"] = json::String(HexEncode(pass2.z));
+            pass2.y = HexDecode((const json::String&) response["y"]);
+            pass2.v = m_crypto.Client2(pass1.x, pass2.y, pass1.sec);
 
-        response = m_httpClient.MakePostRequest(fmt::sprintf("%s/auth/pass2", server), request);
+            request.Clear();
+            request["mpin_id"] = json::String(mpinIdHex);
+            request["WID"] = json::String("");
+            request["OTP"] = json::Boolean(false);
+            request["V"] = json::String(HexEncode(pass2.v));
+            request["Z"] = json::String(HexEncode(pass2.z));
 
-        request.Clear();
-        request["mpinResponse"]["authOTT"] = response["authOTT"];
+            response = m_httpClient.MakePostRequest(fmt::sprintf("%s/auth/pass2", server), request);
 
-        response = m_httpClient.MakePostRequest(fmt::sprintf("%s/auth/authenticate", server), request);
+            request.Clear();
+            request["mpinResponse"]["authOTT"] = response["authOTT"];
+
+            response = m_httpClient.MakePostRequest(fmt::sprintf("%s/auth/authenticate", server), request);
+        }
+        catch (...)
+        {
+            // The precomputation does not depend on the server, so it is kept for the next attempt
+            FinishPrecompute(id, precompute);
+            throw;
+        }
+
+        if (!FinishPrecompute(id, precompute))
+        {
+            throw CryptoError(precompute.GetError());
+        }
+        res.precomputeData = m_cachedPrecompute.g1 + m_cachedPrecompute.g2;
 
         AuthData auth;
         auth.t = HexDecode((const json::String&) response["T"]);
         auth.hm = m_crypto.HashAll(res.clientId, pass1, pass2, auth.t);
-        auth.precomp = m_crypto.Precompute(id.clientSecret, res.clientId);
+        auth.precomp = m_cachedPrecompute;
 
         res.sharedSecret = m_crypto.SharedKey(pass1, pass2, auth);
 
@@ -76,6 +437,105 @@ namespace iot
         return res;
     }
 
+    void MPinFull::ClearPrecomputeCache()
+    {
+        m_cachedMpinId.clear();
+        m_cachedClientSecret.clear();
+        m_cachedHashId.clear();
+        m_cachedPrecompute = PrecomputeData();
+        if (m_pass1Precomputer != NULL)
+        {
+            m_pass1Precomputer->Clear(this);
+        }
+    }
+
+    void MPinFull::SetPass1PoolSize(size_t poolSize)
+    {
+        if (poolSize == 0)
+        {
+            if (m_pass1Precomputer != NULL)
+            {
+                m_pass1Precomputer->Remove(this);
+                Pass1Precomputer::Release();
+                m_pass1Precomputer = NULL;
+            }
+            return;
+        }
+
+        if (m_pass1Precomputer == NULL)
+        {
+            m_pass1Precomputer = Pass1Precomputer::Acquire();
+        }
+        m_pass1Precomputer->SetPoolSize(this, poolSize);
+    }
+
+    unsigned long MPinFull::GetPass1PoolHits() const
+    {
+        return m_pass1PoolHits;
+    }
+
+    unsigned long MPinFull::GetPass1PoolMisses() const
+    {
+        return m_pass1PoolMisses;
+    }
+
+    void MPinFull::StartPrecompute(const Identity & id, PrecomputeTask& task)
+    {
+        if (id.mpinId == m_cachedMpinId && id.clientSecret == m_cachedClientSecret && !m_cachedHashId.empty())
+        {
+            return;
+        }
+
+        ClearPrecomputeCache();
+
+        m_cachedHashId = m_crypto.HashId(id.mpinId);
+        PrecomputeData precomp;
+        if (!m_crypto.ParsePrecomputeData(id.precomputeData, precomp))
+        {
+            task.Start(id.clientSecret, m_cachedHashId);
+            return;
+        }
+
+        m_cachedMpinId = id.mpinId;
+        m_cachedClientSecret = id.clientSecret;
+        m_cachedPrecompute = precomp;
+    }
+
+    bool MPinFull::FinishPrecompute(const Identity & id, PrecomputeTask& task)
+    {
+        if (!task.IsStarted())
+        {
+            return true;
+        }
+
+        if (!task.Wait())
+        {
+            return false;
+        }
+
+        m_cachedMpinId = id.mpinId;
+        m_cachedClientSecret = id.clientSecret;
+        m_cachedPrecompute = task.GetResult();
+        return true;
+    }
+
+    bool MPinFull::TakePrecomputedPass1(const Identity & id, Pass1Data& pass1, Pass2Data& pass2)
+    {
+        if (m_pass1Precomputer == NULL)
+        {
+            return false;
+        }
+
+        if (!m_pass1Precomputer->Take(this, id.mpinId, id.clientSecret, m_cachedHashId, pass1, pass2))
+        {
+            ++m_pass1PoolMisses;
+            return false;
+        }
+
+        ++m_pass1PoolHits;
+        return true;
+    }
+
     Identity MPinFull::RenewExpiredIdentity(const json::Object & renewSecret, const Identity & expiredId)
     {
         Identity newId;
@@ -19,6 +19,7 @@ namespace iot
 
         std::string clientId;
         std::string sharedSecret;
+        std::string precomputeData;
         bool identityChanged;
         Identity newIdentity;
     };
@@ -27,14 +28,37 @@ namespace iot
     {
     public:
         MPinFull(Crypto& crypto);
+        ~MPinFull();
         AuthResult Authenticate(const std::string& server, const Identity& id);
+        void ClearPrecomputeCache();
+        // Keeps up to poolSize sets of single-use pass 1 values for the last authenticated identity, computed in the
+        // background. Zero disables the pool.
+        void SetPass1PoolSize(size_t poolSize);
+        unsigned long GetPass1PoolHits() const;
+        unsigned long GetPass1PoolMisses() const;
 
     private:
+        class PrecomputeTask;
+        class Pass1Precomputer;
+
+        MPinFull(const MPinFull& other);
+        MPinFull& operator=(const MPinFull& other);
+
         AuthResult DoAuth(const std::string& server, const Identity& id);
         Identity RenewExpiredIdentity(const json::Object& renewSecret, const Identity & expiredId);
+        void StartPrecompute(const Identity& id, PrecomputeTask& task);
+        bool FinishPrecompute(const Identity& id, PrecomputeTask& task);
+        bool TakePrecomputedPass1(const Identity& id, Pass1Data& pass1, Pass2Data& pass2);
 
         Crypto& m_crypto;
         JsonHttpClient m_httpClient;
+        std::string m_cachedMpinId;
+        std::string m_cachedClientSecret;
+        std::string m_cachedHashId;
+        PrecomputeData m_cachedPrecompute;
+        Pass1Precomputer *m_pass1Precomputer;
+        unsigned long m_pass1PoolHits;
+        unsigned long m_pass1PoolMisses;
     };
 }
 
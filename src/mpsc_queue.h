@@ -0,0 +1,143 @@
+#ifndef _IOT_MPSC_QUEUE_H_
+#define _IOT_MPSC_QUEUE_H_
+
+#include "atomic.h"
+#include <vector>
+#include <stddef.h>
+
+namespace iot
+{
+    // Bounded lock-free queue with multiple producers and a single consumer. Each slot has a sequence number, which
+    // tells whether the slot is free for the producer at a given position, or holds an item for the consumer, so the
+    // producers compete only for the enqueue position and never wait for each other. Items are swapped in and out of
+    // the slots without copying, so T must have a Swap method.
+    template <typename T>
+    class MpscQueue
+    {
+    public:
+        MpscQueue() : m_mask(0), m_enqueuePos(0), m_dequeuePos(0) {}
+
+        // Not thread safe - must be called while the queue is not in use. The capacity is rounded up to a power of 2.
+        void Init(size_t capacity)
+        {
+            size_t size = 1;
+            while (size < capacity)
+            {
+                size <<= 1;
+            }
+
+            m_cells.assign(size, Cell());
+            for (size_t i = 0; i < size; ++i)
+            {
+                m_cells[i].seq = static_cast<long>(i);
+            }
+            m_mask = size - 1;
+            m_enqueuePos = 0;
+            m_dequeuePos = 0;
+        }
+
+        size_t GetCapacity() const
+        {
+            return m_cells.size();
+        }
+
+        // Can be called from any thread. Returns false if the queue is full.
+        bool Push(T& item)
+        {
+            long pos = AtomicLoad(m_enqueuePos);
+            Cell *cell;
+            while (true)
+            {
+                cell = &m_cells[static_cast<unsigned long>(pos) & m_mask];
+                long diff = Diff(AtomicLoad(cell->seq), pos);
+                if (diff == 0)
+                {
+                    if (AtomicCompareExchange(m_enqueuePos, pos, Add(pos, 1)))
+                    {
+                        break;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    // Another producer has taken the position
+                    pos = AtomicLoad(m_enqueuePos);
+                }
+            }
+
+            cell->item.Swap(item);
+            AtomicStore(cell->seq, Add(pos, 1));
+            return true;
+        }
+
+        // Must be called only from the consumer thread
+        bool Pop(T& item)
+        {
+            long pos = m_dequeuePos;
+            Cell& cell = m_cells[static_cast<unsigned long>(pos) & m_mask];
+            if (Diff(AtomicLoad(cell.seq), Add(pos, 1)) < 0)
+            {
+                return false;
+            }
+
+            // The previous item is released here, so that the free slots do not hold on to any memory
+            T previous;
+            previous.Swap(cell.item);
+            item.Swap(previous);
+            AtomicStore(cell.seq, Add(pos, m_cells.size()));
+            AtomicStore(m_dequeuePos, Add(pos, 1));
+            return true;
+        }
+
+        // Must be called only from the consumer thread
+        bool IsEmpty() const
+        {
+            long pos = m_dequeuePos;
+            return Diff(AtomicLoad(m_cells[static_cast<unsigned long>(pos) & m_mask].seq), Add(pos, 1)) < 0;
+        }
+
+        // Can be called from any thread. The result is approximate while items are being pushed.
+        size_t GetLength() const
+        {
+            long dequeuePos = AtomicLoad(m_dequeuePos);
+            long length = Diff(AtomicLoad(m_enqueuePos), dequeuePos);
+            return length > 0 ? static_cast<size_t>(length) : 0;
+        }
+
+    private:
+        MpscQueue(const MpscQueue& other);
+        MpscQueue& operator=(const MpscQueue& other);
+
+        class Cell
+        {
+        public:
+            Cell() : seq(0) {}
+
+            volatile long seq;
+            T item;
+        };
+
+        // The positions wrap around, so they are computed as unsigned values
+        static long Add(long pos, size_t n)
+        {
+            return static_cast<long>(static_cast<unsigned long>(pos) + static_cast<unsigned long>(n));
+        }
+
+        static long Diff(long a, long b)
+        {
+            return static_cast<long>(static_cast<unsigned long>(a) - static_cast<unsigned long>(b));
+        }
+
+        std::vector<Cell> m_cells;
+        size_t m_mask;
+        volatile long m_enqueuePos;
+        // Keeps the positions of the producers and of the consumer in different cache lines
+        char m_padding[64];
+        volatile long m_dequeuePos;
+    };
+}
+
+#endif // _IOT_MPSC_QUEUE_H_
@@ -1,17 +1,292 @@
 #include "mqtt_tls_client.h"
 #include <fmt/format.h>
 #include <fmt/ostream.h>
+#include <algorithm>
 
 namespace iot
 {
+    namespace
+    {
+        const unsigned char SUBACK_FAILURE = 0x80;
+
+        std::string DescribeTopics(const std::vector<std::string>& topics)
+        {
+            return topics.size() == 1 ? fmt::sprintf("%s topic", topics[0]) : fmt::sprintf("%d topics", topics.size());
+        }
+    }
+
+    MqttTlsClient::ConnectionAdapter::ConnectionAdapter()
+        : m_readBuffer(MBEDTLS_SSL_MAX_CONTENT_LEN), m_readPos(0), m_readEnd(0), m_tlsReadCount(0),
+        m_maxPacketSize(MBEDTLS_SSL_MAX_CONTENT_LEN), m_discardLen(0), m_droppedPacketCount(0), m_sendTimeout(30000),
+        m_tlsWriteCount(0) {}
+
+    int MqttTlsClient::ConnectionAdapter::Connect()
+    {
+        m_readPos = m_readEnd = 0;
+        m_discardLen = 0;
+        m_writeBuffer.clear();
+        int res = TlsConnection::Connect();
+        if (res == 0 && m_readBuffer.size() != GetMaxRecordSize())
+        {
+            // One record is decrypted at a time, so a larger read-ahead buffer would stay unused
+            std::vector<unsigned char>(GetMaxRecordSize()).swap(m_readBuffer);
+        }
+        return res;
+    }
+
+    void MqttTlsClient::ConnectionAdapter::Close()
+    {
+        m_readPos = m_readEnd = 0;
+        m_discardLen = 0;
+        m_writeBuffer.clear();
+        TlsConnection::Close();
+    }
+
     int MqttTlsClient::ConnectionAdapter::read(unsigned char * buffer, int len, int timeoutMillisec)
     {
-        return ReadAll(buffer, len, timeoutMillisec > 0 ? timeoutMillisec : 1);
+        int timeout = timeoutMillisec > 0 ? timeoutMillisec : 1;
+        size_t needed = static_cast<size_t>(len);
+
+        // The rest of a packet, which ReadAvailable has started to drop, is skipped first
+        while (m_discardLen > 0)
+        {
+            if (m_readPos == m_readEnd)
+            {
+                m_readPos = m_readEnd = 0;
+                ++m_tlsReadCount;
+                int res = Read(&m_readBuffer[0], static_cast<int>(m_readBuffer.size()), timeout);
+                if (res <= 0)
+                {
+                    return res;
+                }
+                m_readEnd = res;
+            }
+            DiscardBuffered();
+        }
+
+        if (needed > m_readBuffer.size())
+        {
+            int flushRes = Flush();
+            if (flushRes < 0)
+            {
+                return flushRes;
+            }
+
+            // Does not fit in the read-ahead buffer - hand over the buffered data and read the rest directly
+            size_t buffered = m_readEnd - m_readPos;
+            memcpy(buffer, &m_readBuffer[m_readPos], buffered);
+            m_readPos = m_readEnd = 0;
+            ++m_tlsReadCount;
+            int res = ReadAll(buffer + buffered, len - static_cast<int>(buffered), timeout);
+            return res > 0 ? res + static_cast<int>(buffered) : res;
+        }
+
+        if (m_readEnd - m_readPos < needed && m_readEnd + (needed - (m_readEnd - m_readPos)) > m_readBuffer.size())
+        {
+            memmove(&m_readBuffer[0], &m_readBuffer[m_readPos], m_readEnd - m_readPos);
+            m_readEnd -= m_readPos;
+            m_readPos = 0;
+        }
+
+        // On timeout, the data read so far stays buffered for the next call
+        while (m_readEnd - m_readPos < needed)
+        {
+            // Going to wait for the network - the peer may be waiting for the buffered packets
+            int flushRes = Flush();
+            if (flushRes < 0)
+            {
+                return flushRes;
+            }
+
+            ++m_tlsReadCount;
+            int res = Read(&m_readBuffer[m_readEnd], static_cast<int>(m_readBuffer.size() - m_readEnd), timeout);
+            if (res <= 0)
+            {
+                return res;
+            }
+            m_readEnd += res;
+        }
+
+        memcpy(buffer, &m_readBuffer[m_readPos], needed);
+        m_readPos += needed;
+        if (m_readPos == m_readEnd)
+        {
+            m_readPos = m_readEnd = 0;
+            if (m_readBuffer.size() > GetMaxRecordSize())
+            {
+                // Release the memory, taken by a large packet
+                std::vector<unsigned char>(GetMaxRecordSize()).swap(m_readBuffer);
+            }
+        }
+        return len;
+    }
+
+    int MqttTlsClient::ConnectionAdapter::ReadAvailable()
+    {
+        int total = 0;
+        while (true)
+        {
+            // A packet over the size limit is dropped piece by piece, as it arrives, without waiting for the rest of it
+            if (m_discardLen == 0 && GetBufferedPacketLength() > m_maxPacketSize)
+            {
+                m_discardLen = GetBufferedPacketLength();
+                ++m_droppedPacketCount;
+            }
+            DiscardBuffered();
+
+            if (m_readEnd == m_readBuffer.size() && m_readPos > 0)
+            {
+                memmove(&m_readBuffer[0], &m_readBuffer[m_readPos], m_readEnd - m_readPos);
+                m_readEnd -= m_readPos;
+                m_readPos = 0;
+            }
+
+            // A packet, larger than the buffer, is received as a whole, so that the MQTT engine never waits for it
+            size_t packetLen = GetBufferedPacketLength();
+            if (packetLen > m_readBuffer.size() && packetLen <= m_maxPacketSize)
+            {
+                memmove(&m_readBuffer[0], &m_readBuffer[m_readPos], m_readEnd - m_readPos);
+                m_readEnd -= m_readPos;
+                m_readPos = 0;
+                m_readBuffer.resize(packetLen);
+            }
+
+            if (m_readEnd == m_readBuffer.size())
+            {
+                return total;
+            }
+
+            int res = TlsConnection::ReadAvailable(&m_readBuffer[m_readEnd], static_cast<int>(m_readBuffer.size() - m_readEnd));
+            if (res <= 0)
+            {
+                return res < 0 ? res : total;
+            }
+            ++m_tlsReadCount;
+            m_readEnd += res;
+            total += res;
+        }
+    }
+
+    size_t MqttTlsClient::ConnectionAdapter::GetBufferedPacketLength() const
+    {
+        // Fixed header: packet type byte and the remaining length, encoded in 1 to 4 bytes
+        size_t remainingLen = 0;
+        size_t multiplier = 1;
+        for (size_t pos = m_readPos + 1; pos < m_readEnd && pos <= m_readPos + 4; ++pos)
+        {
+            remainingLen += (m_readBuffer[pos] & 0x7F) * multiplier;
+            if ((m_readBuffer[pos] & 0x80) == 0)
+            {
+                return pos - m_readPos + 1 + remainingLen;
+            }
+            multiplier *= 128;
+        }
+        return 0;
+    }
+
+    bool MqttTlsClient::ConnectionAdapter::HasCompletePacket() const
+    {
+        size_t packetLen = GetBufferedPacketLength();
+        return m_discardLen == 0 && packetLen > 0 && packetLen <= m_maxPacketSize && m_readEnd - m_readPos >= packetLen;
+    }
+
+    void MqttTlsClient::ConnectionAdapter::DiscardBuffered()
+    {
+        size_t len = std::min(m_discardLen, m_readEnd - m_readPos);
+        m_readPos += len;
+        m_discardLen -= len;
+        if (m_readPos == m_readEnd)
+        {
+            m_readPos = m_readEnd = 0;
+        }
     }
 
     int MqttTlsClient::ConnectionAdapter::write(const unsigned char * buffer, int len, int timeoutMillisec)
     {
-        return Write(buffer, len, timeoutMillisec > 0 ? timeoutMillisec : 1);
+        if (!IsConnected())
+        {
+            return Write(buffer, len, m_sendTimeout);
+        }
+
+        size_t maxRecordSize = GetMaxRecordSize();
+        if (m_writeBuffer.size() + len > maxRecordSize)
+        {
+            int res = Flush();
+            if (res < 0)
+            {
+                return res;
+            }
+        }
+
+        if (static_cast<size_t>(len) >= maxRecordSize)
+        {
+            // Large payloads are written directly from the caller's buffer
+            ++m_tlsWriteCount;
+            return Write(buffer, len, m_sendTimeout);
+        }
+
+        m_writeBuffer.insert(m_writeBuffer.end(), buffer, buffer + len);
+        return len;
+    }
+
+    int MqttTlsClient::ConnectionAdapter::Flush()
+    {
+        size_t sent = 0;
+        while (sent < m_writeBuffer.size())
+        {
+            ++m_tlsWriteCount;
+            int res = Write(&m_writeBuffer[sent], static_cast<int>(m_writeBuffer.size() - sent), m_sendTimeout);
+            if (res <= 0)
+            {
+                m_writeBuffer.clear();
+                return res < 0 ? res : -1;
+            }
+            sent += res;
+        }
+
+        m_writeBuffer.clear();
+        return 0;
+    }
+
+    void MqttTlsClient::ConnectionAdapter::SetSendTimeout(int timeoutMillisec)
+    {
+        m_sendTimeout = timeoutMillisec > 0 ? timeoutMillisec : 1;
+    }
+
+    unsigned long MqttTlsClient::ConnectionAdapter::GetTlsWriteCount() const
+    {
+        return m_tlsWriteCount;
+    }
+
+    bool MqttTlsClient::ConnectionAdapter::HasBufferedData() const
+    {
+        // An incomplete packet does not count, as the rest of it has to be received from the network
+        return HasCompletePacket() || GetBytesAvailable() > 0;
+    }
+
+    bool MqttTlsClient::ConnectionAdapter::HasPendingWrite() const
+    {
+        return !m_writeBuffer.empty();
+    }
+
+    void MqttTlsClient::ConnectionAdapter::SetMaxPacketSize(size_t maxPacketSize)
+    {
+        m_maxPacketSize = maxPacketSize;
+    }
+
+    unsigned long MqttTlsClient::ConnectionAdapter::GetDroppedPacketCount() const
+    {
+        return m_droppedPacketCount;
+    }
+
+    unsigned long MqttTlsClient::ConnectionAdapter::GetTlsReadCount() const
+    {
+        return m_tlsReadCount;
+    }
+
+    size_t MqttTlsClient::ConnectionAdapter::GetBufferSize() const
+    {
+        return TlsConnection::GetBufferSize() + m_readBuffer.capacity() + m_writeBuffer.capacity();
     }
 
     MqttTlsClient::TimerAdapter::TimerAdapter() : Timer() {}
@@ -38,13 +313,42 @@ namespace iot
         return IsExpired();
     }
 
+    MqttTlsClient::PublishResult::PublishResult(unsigned short _packetId, bool _ok) : packetId(_packetId), ok(_ok) {}
+
+    MqttTlsClient::PendingPublish::PendingPublish(unsigned short _packetId, MQTT::QoS _qos, bool _notify)
+        : packetId(_packetId), qos(_qos), notify(_notify), payload(NULL), payloadLen(0), released(false) {}
+
+    void MqttTlsClient::PendingPublish::SetPayload(const std::string & message)
+    {
+        payload = reinterpret_cast<const unsigned char *>(message.data());
+        payloadLen = static_cast<int>(message.length());
+    }
+
+    void MqttTlsClient::PendingPublish::KeepPayload()
+    {
+        if (payload != reinterpret_cast<const unsigned char *>(payloadStorage.data()))
+        {
+            payloadStorage.assign(reinterpret_cast<const char *>(payload), payloadLen);
+            payload = reinterpret_cast<const unsigned char *>(payloadStorage.data());
+        }
+    }
+
+    MqttTlsClient::PendingSubscribe::PendingSubscribe(unsigned short _packetId, size_t _firstTopic, int _topicCount)
+        : packetId(_packetId), firstTopic(_firstTopic), topicCount(_topicCount) {}
+
     MqttTlsClient::MqttTlsClient()
-        : m_client(m_connection), m_qos(MQTT::QOS2), m_usePersistentSession(true), m_sessionPresent(false) {}
+        : m_client(m_connection), m_qos(MQTT::QOS2), m_usePersistentSession(true), m_sessionPresent(false),
+        m_commandTimeout(30000), m_publishWindow(0), m_maxTopicsPerSubscribe(0), m_socketOpenTime(0),
+        m_tlsHandshakeTime(0), m_mqttConnectTime(0)
+    {
+        MqttClient::packetHandler ackHandler;
+        ackHandler.attach(this, &MqttTlsClient::OnAck);
+        m_client.setAckHandler(ackHandler);
+    }
 
     void MqttTlsClient::SetId(const std::string & clientId)
     {
         m_clientId = clientId;
-        m_connection.SetPersonalizationData(clientId);
     }
 
     const std::string & MqttTlsClient::GetId() const
@@ -69,7 +373,9 @@ namespace iot
 
     void MqttTlsClient::SetCommandTimeout(unsigned long timeoutMillisec)
     {
+        m_commandTimeout = timeoutMillisec;
         m_client.setCommandTimeout(timeoutMillisec);
+        m_connection.SetSendTimeout(static_cast<int>(timeoutMillisec));
     }
 
     void MqttTlsClient::SetQoS(MQTT::QoS qos)
@@ -82,62 +388,166 @@ namespace iot
         m_usePersistentSession = usePersistentSession;
     }
 
-    bool MqttTlsClient::Connect()
+    void MqttTlsClient::SetPublishWindow(unsigned int windowSize)
+    {
+        m_publishWindow = windowSize;
+    }
+
+    void MqttTlsClient::SetMaxIncomingPacketSize(int maxPacketSize)
+    {
+        m_client.setMaxPacketSize(maxPacketSize);
+        m_connection.SetMaxPacketSize(static_cast<size_t>(maxPacketSize));
+    }
+
+    void MqttTlsClient::SetMaxTopicsPerSubscribe(unsigned int maxTopics)
+    {
+        m_maxTopicsPerSubscribe = maxTopics;
+    }
+
+    void MqttTlsClient::UseTlsSessionResumption(bool useTlsSessionResumption)
+    {
+        m_connection.UseSessionResumption(useTlsSessionResumption);
+    }
+
+    void MqttTlsClient::SetTlsMaxFragmentLength(size_t maxFragmentLength)
+    {
+        m_connection.SetMaxFragmentLength(maxFragmentLength);
+    }
+
+    bool MqttTlsClient::OpenSocket()
+    {
+        long long start = GetTimeMicroseconds();
+        bool ok = m_connection.OpenSocket() == 0;
+        m_socketOpenTime = GetTimeMicroseconds() - start;
+        return ok;
+    }
+
+    void MqttTlsClient::CloseSocket()
+    {
+        m_connection.CloseSocket();
+    }
+
+    bool MqttTlsClient::Connect(const std::vector<std::string>& subscriptions)
     {
-        if (!Connect(true))
+        if (!m_usePersistentSession)
         {
-            return false;
+            return Connect(true, subscriptions);
         }
 
-        if (!m_usePersistentSession)
+        // A session, kept by the broker from an earlier run, is cleared first
+        std::vector<std::string> noSubscriptions;
+        if (!Connect(true, noSubscriptions))
         {
-            return true;
+            return false;
         }
 
         Disconnect();
-        return Connect(false);
+        return Connect(false, subscriptions);
     }
 
-    bool MqttTlsClient::Reconnect()
+    bool MqttTlsClient::Reconnect(const std::vector<std::string>& subscriptions)
     {
         if (!m_usePersistentSession)
         {
-            return Connect(true);
+            return Connect(true, subscriptions);
         }
 
-        return Connect(false);
+        return Connect(false, subscriptions);
     }
 
-    bool MqttTlsClient::Connect(bool cleanSession)
+    bool MqttTlsClient::Connect(bool cleanSession, const std::vector<std::string>& subscriptions)
     {
         if (IsConnected())
         {
             return true;
         }
 
+        // The socket may have been opened already, while authenticating
+        if (!m_connection.IsSocketOpen() && !OpenSocket())
+        {
+            return OnError(fmt::sprintf("Failed to connect to %s", m_connection.GetAddress()));
+        }
+
+        long long handshakeStart = GetTimeMicroseconds();
         if (m_connection.Connect() != 0)
         {
             return OnError(fmt::sprintf("Failed to connect to %s", m_connection.GetAddress()));
         }
 
-        if (!MqttConnect(cleanSession))
+        long long mqttConnectStart = GetTimeMicroseconds();
+        m_tlsHandshakeTime = mqttConnectStart - handshakeStart;
+        TimerAdapter timer(m_commandTimeout);
+        if (!MqttConnect(cleanSession, timer))
+        {
+            m_connection.Close();
+            return false;
+        }
+
+        // A clean session is known to have no subscriptions, so they are restored right behind the CONNECT packet.
+        // Else, they are restored only if the broker has not kept the session.
+        bool restore = !subscriptions.empty();
+        if (restore && cleanSession && !SendSubscribe(subscriptions, timer))
+        {
+            m_connection.Close();
+            return OnError("Failed to restore MQTT subscriptions");
+        }
+
+        if (!WaitForConnack(timer))
         {
             m_connection.Close();
             return false;
         }
 
+        restore = restore && !m_sessionPresent;
+        if (restore && !cleanSession && !SendSubscribe(subscriptions, timer))
+        {
+            Disconnect();
+            return OnError("Failed to restore MQTT subscriptions");
+        }
+
+        if (!ResendPendingPublishes())
+        {
+            Disconnect();
+            return false;
+        }
+
+        if (restore)
+        {
+            if (!WaitForSubscribes(timer))
+            {
+                Disconnect();
+                return OnError("Failed to restore MQTT subscriptions");
+            }
+
+            if (!CheckSubscribeResults(subscriptions))
+            {
+                Disconnect();
+                return false;
+            }
+        }
+
+        m_mqttConnectTime = GetTimeMicroseconds() - mqttConnectStart;
         m_lastError.clear();
         return true;
     }
 
-    bool MqttTlsClient::MqttConnect(bool cleanSession)
+    bool MqttTlsClient::MqttConnect(bool cleanSession, TimerAdapter& timer)
     {
         MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
         data.MQTTVersion = 4;
         data.clientID.lenstring.len = static_cast<int>(m_clientId.length());
         data.clientID.lenstring.data = const_cast<char *>(m_clientId.c_str());
         data.cleansession = cleanSession;
-        if (m_client.connect(data, m_sessionPresent) != 0)
+        if (m_client.sendConnect(data, timer) != MQTT::SUCCESS)
+        {
+            return OnError("Failed to connect MQTT client");
+        }
+        return true;
+    }
+
+    bool MqttTlsClient::WaitForConnack(TimerAdapter& timer)
+    {
+        if (m_client.waitForConnack(m_sessionPresent, timer) != 0)
         {
             return OnError("Failed to connect MQTT client");
         }
@@ -149,9 +559,11 @@ namespace iot
         if (m_client.isConnected())
         {
             m_client.disconnect();
+            m_connection.Flush();
         }
         m_connection.Close();
         m_sessionPresent = false;
+        m_pendingSubscribes.clear();
     }
 
     bool MqttTlsClient::IsConnected()
@@ -186,12 +598,33 @@ namespace iot
 
     bool MqttTlsClient::Subscribe(const std::string & topic)
     {
-        if (m_client.subscribe(topic.c_str(), m_qos, Handler()) != 0)
+        std::vector<bool> granted;
+        return Subscribe(std::vector<std::string>(1, topic), granted);
+    }
+
+    bool MqttTlsClient::Subscribe(const std::vector<std::string>& topics, std::vector<bool>& granted)
+    {
+        granted.assign(topics.size(), false);
+        if (topics.empty())
         {
-            return OnError(fmt::sprintf("Failed to subscribe MQTT client to %s topic", topic));
+            return true;
         }
 
-        return true;
+        if (!m_client.isConnected())
+        {
+            return OnError(fmt::sprintf("Failed to subscribe MQTT client to %s", DescribeTopics(topics)));
+        }
+
+        TimerAdapter timer(m_commandTimeout);
+        bool sent = SendSubscribe(topics, timer) && m_connection.Flush() == 0 && WaitForSubscribes(timer);
+        granted = m_subscribeResults;
+        m_pendingSubscribes.clear();
+        if (!sent)
+        {
+            return OnError(fmt::sprintf("Failed to subscribe MQTT client to %s", DescribeTopics(topics)));
+        }
+
+        return CheckSubscribeResults(topics);
     }
 
     bool MqttTlsClient::Unsubscribe(const std::string & topic)
@@ -206,24 +639,411 @@ namespace iot
 
     bool MqttTlsClient::Publish(const std::string & topic, const std::string & message)
     {
-        MQTT::Message m;
-        m.qos = m_qos;
-        m.retained = false;
-        m.dup = false;
-        m.payload = const_cast<char *>(message.c_str());
-        m.payloadlen = static_cast<int>(message.length());
+        if (!m_client.isConnected())
+        {
+            return OnError(fmt::sprintf("Failed to publish message to %s topic", topic));
+        }
+
+        const unsigned char *payload = reinterpret_cast<const unsigned char *>(message.data());
+        int payloadLen = static_cast<int>(message.length());
 
-        if (m_client.publish(topic.c_str(), m) != 0)
+        if (m_qos == MQTT::QOS0)
         {
+            std::string header;
+            SerializePublishHeader(header, topic, m_qos, false, 0, payloadLen);
+            if (!SendPublish(header, payload, payloadLen, m_qos) || m_connection.Flush() != 0)
+            {
+                return OnError(fmt::sprintf("Failed to publish message to %s topic", topic));
+            }
+            return true;
+        }
+
+        // The payload is sent directly from the caller's buffer. The caller is told about a failure, so the message
+        // is not retransmitted after a reconnect - only the asynchronous publishes are.
+        m_pendingPublishes.push_back(PendingPublish(GetNextPacketId(), m_qos, false));
+        PendingPublish& pending = m_pendingPublishes.back();
+        unsigned short packetId = pending.packetId;
+        SerializePublishHeader(pending.header, topic, m_qos, false, packetId, payloadLen);
+        pending.SetPayload(message);
+
+        if (!SendPublish(pending.header, payload, payloadLen, m_qos) || !WaitForPublishCompletion(packetId))
+        {
+            CompletePublish(packetId, false);
             return OnError(fmt::sprintf("Failed to publish message to %s topic", topic));
         }
 
         return true;
     }
 
+    bool MqttTlsClient::Publish(const std::string & topic, const std::string & message, unsigned short & packetId)
+    {
+        if (m_publishWindow > 0)
+        {
+            return PublishAsync(topic, message, packetId);
+        }
+
+        packetId = 0;
+        return Publish(topic, message);
+    }
+
+    bool MqttTlsClient::GetCompletedPublish(PublishResult & result)
+    {
+        if (m_completedPublishes.empty())
+        {
+            return false;
+        }
+
+        result = m_completedPublishes.front();
+        m_completedPublishes.pop_front();
+        return true;
+    }
+
+    void MqttTlsClient::CancelPendingPublishes()
+    {
+        while (!m_pendingPublishes.empty())
+        {
+            CompletePublish(m_pendingPublishes.front().packetId, false);
+        }
+    }
+
+    bool MqttTlsClient::PublishAsync(const std::string & topic, const std::string & message, unsigned short & packetId)
+    {
+        if (!m_client.isConnected())
+        {
+            return OnError(fmt::sprintf("Failed to publish message to %s topic", topic));
+        }
+
+        if (!WaitForPublishWindow())
+        {
+            return false;
+        }
+
+        m_pendingPublishes.push_back(PendingPublish(GetNextPacketId(), m_qos, true));
+        PendingPublish& pending = m_pendingPublishes.back();
+        SerializePublishHeader(pending.header, topic, m_qos, false, pending.packetId, static_cast<int>(message.length()));
+        pending.SetPayload(message);
+        pending.KeepPayload();
+
+        if (!SendPublish(pending.header, pending.payload, pending.payloadLen, m_qos) || m_connection.Flush() != 0)
+        {
+            m_pendingPublishes.pop_back();
+            return OnError(fmt::sprintf("Failed to publish message to %s topic", topic));
+        }
+
+        packetId = pending.packetId;
+        return true;
+    }
+
+    void MqttTlsClient::SerializePublishHeader(std::string & header, const std::string & topic, MQTT::QoS qos, bool dup,
+        unsigned short packetId, int payloadLen)
+    {
+        MQTTString topicString = MQTTString_initializer;
+        topicString.cstring = const_cast<char *>(topic.c_str());
+        int remainingLen = MQTTSerialize_publishLength(qos, topicString, payloadLen);
+
+        // Fixed header (up to 5 bytes), topic and packet id - the payload is not copied
+        header.resize(5 + 2 + topic.length() + 2);
+        unsigned char *buf = reinterpret_cast<unsigned char *>(&header[0]);
+        unsigned char *ptr = buf;
+
+        MQTTHeader h = { 0 };
+        h.bits.type = PUBLISH;
+        h.bits.dup = dup;
+        h.bits.qos = qos;
+        h.bits.retain = 0;
+        writeChar(&ptr, h.byte);
+        ptr += MQTTPacket_encode(ptr, remainingLen);
+        writeMQTTString(&ptr, topicString);
+        if (qos > 0)
+        {
+            writeInt(&ptr, packetId);
+        }
+
+        header.resize(ptr - buf);
+    }
+
+    bool MqttTlsClient::SendPublish(const std::string & header, const unsigned char * payload, int payloadLen, MQTT::QoS qos)
+    {
+        TimerAdapter timer(m_commandTimeout);
+        if (m_client.sendPacket(reinterpret_cast<const unsigned char *>(header.data()), static_cast<int>(header.length()), timer) != MQTT::SUCCESS)
+        {
+            return false;
+        }
+
+        return payloadLen == 0 || m_client.sendPacket(payload, payloadLen, timer) == MQTT::SUCCESS;
+    }
+
+    bool MqttTlsClient::SendSubscribe(const std::vector<std::string>& topics, TimerAdapter & timer)
+    {
+        m_pendingSubscribes.clear();
+        m_subscribeResults.assign(topics.size(), false);
+
+        // All SUBSCRIBE packets are sent at once and the SUBACKs are matched by packet id
+        size_t maxTopics = m_maxTopicsPerSubscribe > 0 ? m_maxTopicsPerSubscribe : topics.size();
+        MQTTString emptyFilter = MQTTString_initializer;
+        std::vector<MQTTString> filters;
+        std::vector<int> qos;
+        std::vector<unsigned char> packet;
+        for (size_t first = 0; first < topics.size(); first += maxTopics)
+        {
+            int count = static_cast<int>(std::min(maxTopics, topics.size() - first));
+            filters.assign(count, emptyFilter);
+            qos.assign(count, m_qos);
+            // Fixed header (up to 5 bytes), packet id and every topic with its length and requested QoS
+            size_t packetLen = 5 + 2;
+            for (int i = 0; i < count; ++i)
+            {
+                filters[i].cstring = const_cast<char *>(topics[first + i].c_str());
+                packetLen += 2 + topics[first + i].length() + 1;
+            }
+
+            packet.resize(packetLen);
+            unsigned short packetId = GetNextPacketId();
+            int len = MQTTSerialize_subscribe(&packet[0], static_cast<int>(packet.size()), 0, packetId, count, &filters[0], &qos[0]);
+            if (len <= 0 || m_client.sendPacket(&packet[0], len, timer) != MQTT::SUCCESS)
+            {
+                return false;
+            }
+
+            m_pendingSubscribes.push_back(PendingSubscribe(packetId, first, count));
+        }
+        return true;
+    }
+
+    bool MqttTlsClient::WaitForSubscribes(TimerAdapter & timer)
+    {
+        while (!m_pendingSubscribes.empty())
+        {
+            if (timer.expired())
+            {
+                return false;
+            }
+
+            if (m_client.cycle(timer) < 0 && !m_connection.IsConnected())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool MqttTlsClient::CheckSubscribeResults(const std::vector<std::string>& topics)
+    {
+        for (size_t i = 0; i < topics.size(); ++i)
+        {
+            if (!m_subscribeResults[i])
+            {
+                return OnError(fmt::sprintf("Failed to subscribe MQTT client to %s topic", topics[i]), "Rejected by the broker");
+            }
+        }
+        return true;
+    }
+
+    bool MqttTlsClient::WaitForPublishWindow()
+    {
+        TimerAdapter timer(m_commandTimeout);
+        while (m_pendingPublishes.size() >= m_publishWindow)
+        {
+            if (timer.expired())
+            {
+                return OnError("Failed to publish message", "Timed out waiting for a free slot in the publish window");
+            }
+
+            if (m_client.cycle(timer) < 0 && !m_connection.IsConnected())
+            {
+                return OnError("Failed to publish message");
+            }
+        }
+        return true;
+    }
+
+    bool MqttTlsClient::WaitForPublishCompletion(unsigned short packetId)
+    {
+        TimerAdapter timer(m_commandTimeout);
+        while (IsPublishPending(packetId))
+        {
+            if (timer.expired())
+            {
+                return false;
+            }
+
+            if (m_client.cycle(timer) < 0 && !m_connection.IsConnected())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool MqttTlsClient::ResendPendingPublishes()
+    {
+        TimerAdapter timer(m_commandTimeout);
+        for (PendingPublishes::iterator p = m_pendingPublishes.begin(); p != m_pendingPublishes.end(); ++p)
+        {
+            int rc = MQTT::FAILURE;
+            if (p->released && m_sessionPresent)
+            {
+                unsigned char buf[4];
+                int len = MQTTSerialize_pubrel(buf, sizeof(buf), 0, p->packetId);
+                rc = m_client.sendPacket(buf, len, timer);
+            }
+            else
+            {
+                MQTTHeader header = { 0 };
+                header.byte = p->header[0];
+                header.bits.dup = 1;
+                p->header[0] = header.byte;
+                p->released = false;
+                rc = m_client.sendPacket(reinterpret_cast<const unsigned char *>(p->header.data()), static_cast<int>(p->header.length()), timer);
+                if (rc == MQTT::SUCCESS && p->payloadLen > 0)
+                {
+                    rc = m_client.sendPacket(p->payload, p->payloadLen, timer);
+                }
+            }
+
+            if (rc != MQTT::SUCCESS)
+            {
+                return OnError(fmt::sprintf("Failed to resend pending publish with packet id %d", p->packetId));
+            }
+        }
+
+        if (m_connection.Flush() != 0)
+        {
+            return OnError("Failed to resend pending publishes");
+        }
+        return true;
+    }
+
+    unsigned short MqttTlsClient::GetNextPacketId()
+    {
+        while (true)
+        {
+            // The subscribes, pipelined behind CONNECT, may still be waiting for their SUBACKs
+            unsigned short packetId = m_client.getNextPacketId();
+            PendingSubscribes::const_iterator s = m_pendingSubscribes.begin();
+            while (s != m_pendingSubscribes.end() && s->packetId != packetId)
+            {
+                ++s;
+            }
+
+            if (s == m_pendingSubscribes.end() && !IsPublishPending(packetId))
+            {
+                return packetId;
+            }
+        }
+    }
+
+    bool MqttTlsClient::IsPublishPending(unsigned short packetId) const
+    {
+        for (PendingPublishes::const_iterator p = m_pendingPublishes.begin(); p != m_pendingPublishes.end(); ++p)
+        {
+            if (p->packetId == packetId)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void MqttTlsClient::OnAck(MQTT::PacketData & pd)
+    {
+        if (pd.type == SUBACK)
+        {
+            OnSubAck(pd);
+            return;
+        }
+
+        unsigned short packetId;
+        unsigned char dup, type;
+        if (MQTTDeserialize_ack(&type, &dup, &packetId, pd.buf, pd.buflen) != 1)
+        {
+            return;
+        }
+
+        if (pd.type == PUBREC)
+        {
+            for (PendingPublishes::iterator p = m_pendingPublishes.begin(); p != m_pendingPublishes.end(); ++p)
+            {
+                if (p->packetId == packetId)
+                {
+                    p->released = true;
+                    break;
+                }
+            }
+            return;
+        }
+
+        CompletePublish(packetId, true);
+    }
+
+    void MqttTlsClient::OnSubAck(MQTT::PacketData & pd)
+    {
+        unsigned short packetId;
+        int count = 0;
+        std::vector<int> grantedQoS(pd.buflen);
+        if (MQTTDeserialize_suback(&packetId, pd.buflen, &count, &grantedQoS[0], pd.buf, pd.buflen) != 1)
+        {
+            return;
+        }
+
+        for (PendingSubscribes::iterator p = m_pendingSubscribes.begin(); p != m_pendingSubscribes.end(); ++p)
+        {
+            if (p->packetId == packetId)
+            {
+                for (int i = 0; i < count && i < p->topicCount; ++i)
+                {
+                    m_subscribeResults[p->firstTopic + i] = static_cast<unsigned char>(grantedQoS[i]) != SUBACK_FAILURE;
+                }
+                m_pendingSubscribes.erase(p);
+                return;
+            }
+        }
+    }
+
+    void MqttTlsClient::CompletePublish(unsigned short packetId, bool ok)
+    {
+        for (PendingPublishes::iterator p = m_pendingPublishes.begin(); p != m_pendingPublishes.end(); ++p)
+        {
+            if (p->packetId == packetId)
+            {
+                if (p->notify)
+                {
+                    m_completedPublishes.push_back(PublishResult(packetId, ok));
+                }
+                m_pendingPublishes.erase(p);
+                return;
+            }
+        }
+    }
+
+    bool MqttTlsClient::IsPublishWindowFull() const
+    {
+        return m_pendingPublishes.size() >= m_publishWindow;
+    }
+
     bool MqttTlsClient::RunMessageLoop(unsigned long timeoutMillisec)
     {
-        int res = m_client.yield(timeoutMillisec);
+        // Same as MQTT::Client::yield, but returns as soon as a publish completes, so the publish window can be refilled
+        TimerAdapter timer(static_cast<int>(timeoutMillisec));
+        int res = MQTT::SUCCESS;
+        while (!timer.expired() && m_completedPublishes.empty())
+        {
+            res = m_client.cycle(timer);
+            if (res < 0)
+            {
+                if (res != MQTT::BUFFER_OVERFLOW)
+                {
+                    res = MQTT::FAILURE;
+                }
+                break;
+            }
+            res = MQTT::SUCCESS;
+        }
+
+        if (m_connection.Flush() != 0)
+        {
+            res = MQTT::FAILURE;
+        }
         if (res < 0)
         {
             // TODO: Check why sometimes the connection is OK, no timeout occured, but still yeld returns FAILURE
@@ -234,21 +1054,143 @@ namespace iot
             }
             else
             {
-                // TODO: Currently MQTT::Client::yield must be fixed to enable this check
                 if (res == MQTT::BUFFER_OVERFLOW)
                 {
-                    return OnError(fmt::sprintf("MQTT message loop failed with code %d", res), "Buffer overflow");
+                    return OnError("Dropped incoming MQTT packet", "Packet exceeds the maximum incoming packet size");
                 }
             }
         }
         return true;
     }
 
+    bool MqttTlsClient::ProcessIO()
+    {
+        // Same as RunMessageLoop, but processes only the packets, which are already received, without waiting
+        int res = MQTT::SUCCESS;
+        unsigned long droppedPackets = m_connection.GetDroppedPacketCount();
+        bool overflow = false;
+        while (res >= 0)
+        {
+            if (m_connection.ReadAvailable() < 0)
+            {
+                res = MQTT::FAILURE;
+                break;
+            }
+            if (!m_connection.HasCompletePacket())
+            {
+                break;
+            }
+
+            // Only complete packets are processed, so the MQTT engine never waits for the rest of a packet
+            while (res >= 0 && m_connection.HasCompletePacket())
+            {
+                TimerAdapter timer(static_cast<int>(m_commandTimeout));
+                res = m_client.cycle(timer);
+                if (res == MQTT::BUFFER_OVERFLOW)
+                {
+                    // Not fatal - the rest of the packets are still processed
+                    overflow = true;
+                    res = MQTT::SUCCESS;
+                }
+            }
+        }
+        m_client.keepalive();
+
+        if (m_connection.Flush() != 0)
+        {
+            res = MQTT::FAILURE;
+        }
+        if (res < 0 && !m_connection.IsConnected())
+        {
+            return OnError(fmt::sprintf("MQTT message loop failed with code %d", res));
+        }
+        if (overflow || m_connection.GetDroppedPacketCount() != droppedPackets)
+        {
+            return OnError("Dropped incoming MQTT packet", "Packet exceeds the maximum incoming packet size");
+        }
+        return true;
+    }
+
+    int MqttTlsClient::GetSocket() const
+    {
+        return m_connection.GetSocket();
+    }
+
+    bool MqttTlsClient::HasBufferedData() const
+    {
+        return m_connection.HasBufferedData();
+    }
+
+    bool MqttTlsClient::HasPendingWrite() const
+    {
+        return m_connection.HasPendingWrite();
+    }
+
+    int MqttTlsClient::GetKeepAliveLeftMilliseconds()
+    {
+        return m_client.getKeepAliveLeftMs();
+    }
+
     std::string MqttTlsClient::GetCiphersuite() const
     {
         return m_connection.GetCiphersuite();
     }
 
+    bool MqttTlsClient::IsHandshakeFailed() const
+    {
+        return m_connection.IsHandshakeFailed();
+    }
+
+    unsigned long MqttTlsClient::GetTlsReadCount() const
+    {
+        return m_connection.GetTlsReadCount();
+    }
+
+    unsigned long MqttTlsClient::GetTlsWriteCount() const
+    {
+        return m_connection.GetTlsWriteCount();
+    }
+
+    unsigned long MqttTlsClient::GetTlsHandshakeCount() const
+    {
+        return m_connection.GetHandshakeCount();
+    }
+
+    unsigned long MqttTlsClient::GetTlsResumedHandshakeCount() const
+    {
+        return m_connection.GetResumedHandshakeCount();
+    }
+
+    size_t MqttTlsClient::GetTlsBufferSize() const
+    {
+        return m_connection.GetBufferSize();
+    }
+
+    unsigned long MqttTlsClient::GetSocketOpenMicrosec() const
+    {
+        return static_cast<unsigned long>(m_socketOpenTime);
+    }
+
+    unsigned long MqttTlsClient::GetTlsHandshakeMicrosec() const
+    {
+        return static_cast<unsigned long>(m_tlsHandshakeTime);
+    }
+
+    unsigned long MqttTlsClient::GetMqttConnectMicrosec() const
+    {
+        return static_cast<unsigned long>(m_mqttConnectTime);
+    }
+
+    unsigned long MqttTlsClient::GetIncomingQoS2Count() const
+    {
+        return m_client.getIncomingQoS2Count();
+    }
+
+    unsigned long MqttTlsClient::GetIncomingQoS2MaxCount() const
+    {
+        return m_client.getIncomingQoS2MaxCount();
+    }
+
     const std::string & MqttTlsClient::GetLastError() const
     {
         return m_lastError;
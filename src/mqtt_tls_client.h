@@ -4,13 +4,15 @@
 #include <net/tls_connection.h>
 #include "timer.h"
 #define MQTTCLIENT_QOS2 1
-#define MAX_INCOMING_QOS2_MESSAGES 10
 #ifdef _WIN32
 #define __PRETTY_FUNCTION__ __func__
 #endif
 #include <string.h>
 #include <MQTTClient.h>
 #include <string>
+#include <list>
+#include <deque>
+#include <vector>
 
 namespace iot
 {
@@ -20,8 +22,40 @@ namespace iot
         class ConnectionAdapter : public net::TlsConnection
         {
         public:
+            ConnectionAdapter();
+            virtual int Connect();
+            virtual void Close();
             int read(unsigned char* buffer, int len, int timeoutMillisec);
             int write(const unsigned char* buffer, int len, int timeoutMillisec);
+            int Flush();
+            int ReadAvailable();
+            bool HasCompletePacket() const;
+            bool HasBufferedData() const;
+            bool HasPendingWrite() const;
+            void SetSendTimeout(int timeoutMillisec);
+            void SetMaxPacketSize(size_t maxPacketSize);
+            unsigned long GetTlsReadCount() const;
+            unsigned long GetTlsWriteCount() const;
+            unsigned long GetDroppedPacketCount() const;
+            size_t GetBufferSize() const;
+
+        private:
+            size_t GetBufferedPacketLength() const;
+            void DiscardBuffered();
+
+            // Decrypted data, read ahead of the MQTT engine, which reads every packet in small pieces
+            std::vector<unsigned char> m_readBuffer;
+            size_t m_readPos;
+            size_t m_readEnd;
+            unsigned long m_tlsReadCount;
+            size_t m_maxPacketSize;
+            // Bytes left of a packet over the size limit, which is dropped as it arrives
+            size_t m_discardLen;
+            unsigned long m_droppedPacketCount;
+            // Packets waiting to be sent together in one TLS record
+            std::vector<unsigned char> m_writeBuffer;
+            int m_sendTimeout;
+            unsigned long m_tlsWriteCount;
         };
 
         class TimerAdapter : public Timer
@@ -38,6 +72,15 @@ namespace iot
         typedef MQTT::Client<ConnectionAdapter, TimerAdapter, 1024, 0> MqttClient;
         typedef MqttClient::messageHandler Handler;
 
+        class PublishResult
+        {
+        public:
+            PublishResult(unsigned short _packetId, bool _ok);
+
+            unsigned short packetId;
+            bool ok;
+        };
+
         MqttTlsClient();
         void SetId(const std::string& clientId);
         const std::string& GetId() const;
@@ -47,23 +90,101 @@ namespace iot
         void SetCommandTimeout(unsigned long timeoutMillisec);
         void SetQoS(MQTT::QoS qos);
         void UsePersistentSession(bool usePersistentSession);
-        bool Connect();
-        bool Reconnect();
+        void SetPublishWindow(unsigned int windowSize);
+        void SetMaxIncomingPacketSize(int maxPacketSize);
+        void SetMaxTopicsPerSubscribe(unsigned int maxTopics);
+        void UseTlsSessionResumption(bool useTlsSessionResumption);
+        void SetTlsMaxFragmentLength(size_t maxFragmentLength);
+        // Opens the TCP connection to the broker ahead of Connect. May be called from another thread, while the PSK is
+        // being obtained.
+        bool OpenSocket();
+        void CloseSocket();
+        bool Connect(const std::vector<std::string>& subscriptions);
+        bool Reconnect(const std::vector<std::string>& subscriptions);
         void Disconnect();
         bool IsConnected();
         bool IsSessionPresent() const;
         bool Subscribe(const std::string& topic);
+        bool Subscribe(const std::vector<std::string>& topics, std::vector<bool>& granted);
         bool Unsubscribe(const std::string& topic);
         bool Publish(const std::string& topic, const std::string& message);
+        bool Publish(const std::string& topic, const std::string& message, unsigned short& packetId);
+        bool GetCompletedPublish(PublishResult& result);
+        void CancelPendingPublishes();
+        bool IsPublishWindowFull() const;
         bool RunMessageLoop(unsigned long timeoutMillisec);
+        bool ProcessIO();
+        int GetSocket() const;
+        bool HasBufferedData() const;
+        bool HasPendingWrite() const;
+        int GetKeepAliveLeftMilliseconds();
         std::string GetCiphersuite() const;
+        bool IsHandshakeFailed() const;
+        unsigned long GetTlsReadCount() const;
+        unsigned long GetTlsWriteCount() const;
+        unsigned long GetTlsHandshakeCount() const;
+        unsigned long GetTlsResumedHandshakeCount() const;
+        size_t GetTlsBufferSize() const;
+        unsigned long GetSocketOpenMicrosec() const;
+        unsigned long GetTlsHandshakeMicrosec() const;
+        unsigned long GetMqttConnectMicrosec() const;
+        unsigned long GetIncomingQoS2Count() const;
+        unsigned long GetIncomingQoS2MaxCount() const;
         const std::string& GetLastError() const;
 
     protected:
-        bool Connect(bool cleanSession);
-        bool MqttConnect(bool cleanSession);
+        bool Connect(bool cleanSession, const std::vector<std::string>& subscriptions);
+        bool MqttConnect(bool cleanSession, TimerAdapter& timer);
+        bool WaitForConnack(TimerAdapter& timer);
+        bool SendSubscribe(const std::vector<std::string>& topics, TimerAdapter& timer);
+        bool WaitForSubscribes(TimerAdapter& timer);
+        bool CheckSubscribeResults(const std::vector<std::string>& topics);
         bool OnError(const std::string& error);
         bool OnError(const std::string& error, const std::string& reason);
+        bool PublishAsync(const std::string& topic, const std::string& message, unsigned short& packetId);
+        bool WaitForPublishWindow();
+        bool WaitForPublishCompletion(unsigned short packetId);
+        bool ResendPendingPublishes();
+        unsigned short GetNextPacketId();
+        bool IsPublishPending(unsigned short packetId) const;
+        void OnAck(MQTT::PacketData& pd);
+        void OnSubAck(MQTT::PacketData& pd);
+        void CompletePublish(unsigned short packetId, bool ok);
+
+        class PendingPublish
+        {
+        public:
+            PendingPublish(unsigned short _packetId, MQTT::QoS _qos, bool _notify);
+            void SetPayload(const std::string& message);
+            void KeepPayload();
+
+            unsigned short packetId;
+            MQTT::QoS qos;
+            bool notify;
+            std::string header;
+            const unsigned char *payload;
+            int payloadLen;
+            std::string payloadStorage;
+            bool released;
+        };
+
+        typedef std::list<PendingPublish> PendingPublishes;
+
+        class PendingSubscribe
+        {
+        public:
+            PendingSubscribe(unsigned short _packetId, size_t _firstTopic, int _topicCount);
+
+            unsigned short packetId;
+            size_t firstTopic;
+            int topicCount;
+        };
+
+        typedef std::list<PendingSubscribe> PendingSubscribes;
+
+        static void SerializePublishHeader(std::string& header, const std::string& topic, MQTT::QoS qos, bool dup,
+            unsigned short packetId, int payloadLen);
+        bool SendPublish(const std::string& header, const unsigned char *payload, int payloadLen, MQTT::QoS qos);
 
         ConnectionAdapter m_connection;
         MqttClient m_client;
@@ -72,6 +193,16 @@ namespace iot
         bool m_usePersistentSession;
         std::string m_lastError;
         bool m_sessionPresent;
+        unsigned long m_commandTimeout;
+        unsigned int m_publishWindow;
+        PendingPublishes m_pendingPublishes;
+        std::deque<PublishResult> m_completedPublishes;
+        unsigned int m_maxTopicsPerSubscribe;
+        PendingSubscribes m_pendingSubscribes;
+        std::vector<bool> m_subscribeResults;
+        long long m_socketOpenTime;
+        long long m_tlsHandshakeTime;
+        long long m_mqttConnectTime;
     };
 }
 
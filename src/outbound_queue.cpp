@@ -0,0 +1,427 @@
+#include "outbound_queue.h"
+#include <fmt/format.h>
+#include <string.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+namespace iot
+{
+    namespace
+    {
+        const char QUEUE_MAGIC[4] = { 'I', 'O', 'T', 'Q' };
+        const uint32_t QUEUE_VERSION = 1;
+        const uint64_t DATA_OFFSET = 64;
+
+        std::string GetSystemError()
+        {
+#ifdef _WIN32
+            return fmt::sprintf("error code %d", ::GetLastError());
+#else
+            return strerror(errno);
+#endif
+        }
+    }
+
+    OutboundQueue::Message::Message() : seq(0) {}
+
+    OutboundQueue::OutboundQueue() : m_dropOldest(false),
+#ifdef _WIN32
+        m_file(INVALID_HANDLE_VALUE), m_mapping(NULL),
+#else
+        m_file(-1),
+#endif
+        m_view(NULL), m_viewSize(0), m_header(NULL), m_data(NULL), m_cursor(0), m_cursorIndex(0), m_droppedCount(0) {}
+
+    OutboundQueue::~OutboundQueue()
+    {
+        Close();
+    }
+
+    bool OutboundQueue::Open(const std::string & path, size_t maxSize, bool dropOldest)
+    {
+        Close();
+
+        uint64_t fileSize = 0;
+        Header header;
+        if (!OpenFile(path, fileSize, header))
+        {
+            Close();
+            return false;
+        }
+
+        // An existing queue is kept as it is, unless it is empty and its size has to be changed
+        bool valid = IsValid(header, fileSize);
+        bool init = !valid || (header.count == 0 && header.capacity != maxSize);
+        uint64_t nextSeq = valid ? header.nextSeq : 1;
+        if (init)
+        {
+            fileSize = DATA_OFFSET + maxSize;
+            if (!ResizeFile(fileSize))
+            {
+                Close();
+                return false;
+            }
+        }
+
+        if (!MapFile(fileSize))
+        {
+            Close();
+            return false;
+        }
+
+        m_header = static_cast<Header *>(m_view);
+        m_data = static_cast<unsigned char *>(m_view) + DATA_OFFSET;
+        if (init)
+        {
+            memset(m_header, 0, sizeof(Header));
+            memcpy(m_header->magic, QUEUE_MAGIC, sizeof(QUEUE_MAGIC));
+            m_header->version = QUEUE_VERSION;
+            m_header->capacity = maxSize;
+            m_header->nextSeq = nextSeq;
+        }
+
+        m_path = path;
+        m_dropOldest = dropOldest;
+        Rewind();
+        return true;
+    }
+
+    void OutboundQueue::Close()
+    {
+#ifdef _WIN32
+        if (m_view != NULL)
+        {
+            UnmapViewOfFile(m_view);
+        }
+        if (m_mapping != NULL)
+        {
+            CloseHandle(m_mapping);
+            m_mapping = NULL;
+        }
+        if (m_file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_file);
+            m_file = INVALID_HANDLE_VALUE;
+        }
+#else
+        if (m_view != NULL)
+        {
+            munmap(m_view, m_viewSize);
+        }
+        if (m_file >= 0)
+        {
+            close(m_file);
+            m_file = -1;
+        }
+#endif
+        m_view = NULL;
+        m_viewSize = 0;
+        m_header = NULL;
+        m_data = NULL;
+        m_path.clear();
+    }
+
+    bool OutboundQueue::IsOpen() const
+    {
+        return m_header != NULL;
+    }
+
+    const std::string & OutboundQueue::GetPath() const
+    {
+        return m_path;
+    }
+
+    bool OutboundQueue::Push(const std::string & topic, const std::string & payload)
+    {
+        if (!IsOpen())
+        {
+            return OnError("Outbound queue is not open");
+        }
+
+        uint64_t recordLen = sizeof(RecordHeader) + topic.length() + payload.length();
+        if (recordLen > m_header->capacity)
+        {
+            return OnError(fmt::sprintf("Message of %d bytes does not fit in the outbound queue", payload.length()));
+        }
+
+        while (m_header->capacity - m_header->used < recordLen)
+        {
+            if (!m_dropOldest)
+            {
+                return OnError("Outbound queue is full");
+            }
+            RemoveHead();
+            ++m_droppedCount;
+        }
+
+        RecordHeader record;
+        record.topicLen = static_cast<uint32_t>(topic.length());
+        record.payloadLen = static_cast<uint32_t>(payload.length());
+        record.seq = m_header->nextSeq;
+
+        uint64_t offset = m_header->tail;
+        Write(offset, &record, sizeof(record));
+        offset = Advance(offset, sizeof(record));
+        Write(offset, topic.data(), topic.length());
+        offset = Advance(offset, topic.length());
+        Write(offset, payload.data(), payload.length());
+
+        // The record is committed by updating the header after its data is written
+        m_header->tail = Advance(offset, payload.length());
+        m_header->used += recordLen;
+        ++m_header->count;
+        ++m_header->nextSeq;
+        return true;
+    }
+
+    bool OutboundQueue::Peek(Message & message)
+    {
+        if (!IsOpen() || m_cursorIndex >= m_header->count)
+        {
+            return false;
+        }
+
+        RecordHeader record;
+        if (!ReadRecord(m_cursor, record))
+        {
+            return false;
+        }
+        uint64_t offset = Advance(m_cursor, sizeof(record));
+        message.seq = record.seq;
+        message.topic.resize(record.topicLen);
+        if (record.topicLen > 0)
+        {
+            Read(offset, &message.topic[0], record.topicLen);
+        }
+        offset = Advance(offset, record.topicLen);
+        message.payload.resize(record.payloadLen);
+        if (record.payloadLen > 0)
+        {
+            Read(offset, &message.payload[0], record.payloadLen);
+        }
+        return true;
+    }
+
+    void OutboundQueue::Next()
+    {
+        if (!IsOpen() || m_cursorIndex >= m_header->count)
+        {
+            return;
+        }
+
+        RecordHeader record;
+        if (!ReadRecord(m_cursor, record))
+        {
+            return;
+        }
+        m_cursor = Advance(m_cursor, sizeof(record) + record.topicLen + record.payloadLen);
+        ++m_cursorIndex;
+    }
+
+    void OutboundQueue::Rewind()
+    {
+        m_cursor = IsOpen() ? m_header->head : 0;
+        m_cursorIndex = 0;
+    }
+
+    void OutboundQueue::Pop(uint64_t seq)
+    {
+        while (IsOpen() && m_header->count > 0)
+        {
+            RecordHeader record;
+            if (!ReadRecord(m_header->head, record) || record.seq > seq)
+            {
+                break;
+            }
+            RemoveHead();
+        }
+    }
+
+    size_t OutboundQueue::GetLength() const
+    {
+        return IsOpen() ? static_cast<size_t>(m_header->count) : 0;
+    }
+
+    unsigned long OutboundQueue::GetDroppedCount() const
+    {
+        return m_droppedCount;
+    }
+
+    const std::string & OutboundQueue::GetLastError() const
+    {
+        return m_lastError;
+    }
+
+    bool OutboundQueue::OpenFile(const std::string & path, uint64_t & fileSize, Header & header)
+    {
+        memset(&header, 0, sizeof(header));
+#ifdef _WIN32
+        m_file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (m_file == INVALID_HANDLE_VALUE)
+        {
+            return OnError(fmt::sprintf("Failed to open outbound queue file %s: %s", path, GetSystemError()));
+        }
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size))
+        {
+            return OnError(fmt::sprintf("Failed to get size of outbound queue file %s: %s", path, GetSystemError()));
+        }
+        fileSize = size.QuadPart;
+
+        DWORD read = 0;
+        if (fileSize >= sizeof(header) && (!ReadFile(m_file, &header, sizeof(header), &read, NULL) || read != sizeof(header)))
+        {
+            return OnError(fmt::sprintf("Failed to read outbound queue file %s: %s", path, GetSystemError()));
+        }
+#else
+        m_file = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+        if (m_file < 0)
+        {
+            return OnError(fmt::sprintf("Failed to open outbound queue file %s: %s", path, GetSystemError()));
+        }
+
+        struct stat st;
+        if (fstat(m_file, &st) != 0)
+        {
+            return OnError(fmt::sprintf("Failed to get size of outbound queue file %s: %s", path, GetSystemError()));
+        }
+        fileSize = st.st_size;
+
+        if (fileSize >= sizeof(header) && pread(m_file, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)))
+        {
+            return OnError(fmt::sprintf("Failed to read outbound queue file %s: %s", path, GetSystemError()));
+        }
+#endif
+        return true;
+    }
+
+    bool OutboundQueue::ResizeFile(uint64_t fileSize)
+    {
+#ifdef _WIN32
+        LARGE_INTEGER size;
+        size.QuadPart = fileSize;
+        if (!SetFilePointerEx(m_file, size, NULL, FILE_BEGIN) || !SetEndOfFile(m_file))
+        {
+            return OnError(fmt::sprintf("Failed to resize outbound queue file: %s", GetSystemError()));
+        }
+#else
+        if (ftruncate(m_file, static_cast<off_t>(fileSize)) != 0)
+        {
+            return OnError(fmt::sprintf("Failed to resize outbound queue file: %s", GetSystemError()));
+        }
+#endif
+        return true;
+    }
+
+    bool OutboundQueue::MapFile(uint64_t fileSize)
+    {
+        m_viewSize = static_cast<size_t>(fileSize);
+#ifdef _WIN32
+        m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READWRITE, 0, 0, NULL);
+        if (m_mapping != NULL)
+        {
+            m_view = MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, m_viewSize);
+        }
+#else
+        m_view = mmap(NULL, m_viewSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, 0);
+        if (m_view == MAP_FAILED)
+        {
+            m_view = NULL;
+        }
+#endif
+        if (m_view == NULL)
+        {
+            return OnError(fmt::sprintf("Failed to map outbound queue file: %s", GetSystemError()));
+        }
+        return true;
+    }
+
+    bool OutboundQueue::IsValid(const Header & header, uint64_t fileSize) const
+    {
+        return memcmp(header.magic, QUEUE_MAGIC, sizeof(QUEUE_MAGIC)) == 0 && header.version == QUEUE_VERSION &&
+            header.capacity > 0 && fileSize == DATA_OFFSET + header.capacity && header.head < header.capacity &&
+            header.tail < header.capacity && header.used <= header.capacity && header.count <= header.used;
+    }
+
+    void OutboundQueue::Read(uint64_t offset, void * data, size_t len) const
+    {
+        size_t first = static_cast<size_t>(std::min<uint64_t>(len, m_header->capacity - offset));
+        memcpy(data, m_data + offset, first);
+        memcpy(static_cast<unsigned char *>(data) + first, m_data, len - first);
+    }
+
+    void OutboundQueue::Write(uint64_t offset, const void * data, size_t len)
+    {
+        size_t first = static_cast<size_t>(std::min<uint64_t>(len, m_header->capacity - offset));
+        memcpy(m_data + offset, data, first);
+        memcpy(m_data, static_cast<const unsigned char *>(data) + first, len - first);
+    }
+
+    uint64_t OutboundQueue::Advance(uint64_t offset, uint64_t len) const
+    {
+        return (offset + len) % m_header->capacity;
+    }
+
+    bool OutboundQueue::ReadRecord(uint64_t offset, RecordHeader & record)
+    {
+        // The lengths come from the file, so a torn or corrupt record must not make the reads run past the queued data
+        uint64_t skipped = (offset + m_header->capacity - m_header->head) % m_header->capacity;
+        if (m_header->used >= skipped + sizeof(record))
+        {
+            Read(offset, &record, sizeof(record));
+            if (static_cast<uint64_t>(record.topicLen) + record.payloadLen <= m_header->used - skipped - sizeof(record))
+            {
+                return true;
+            }
+        }
+
+        m_droppedCount += static_cast<unsigned long>(m_header->count);
+        m_header->head = m_header->tail = 0;
+        m_header->used = 0;
+        m_header->count = 0;
+        Rewind();
+        return OnError("Outbound queue data is corrupt, the queued messages are dropped");
+    }
+
+    void OutboundQueue::RemoveHead()
+    {
+        RecordHeader record;
+        if (!ReadRecord(m_header->head, record))
+        {
+            return;
+        }
+        uint64_t recordLen = sizeof(record) + record.topicLen + record.payloadLen;
+        m_header->head = Advance(m_header->head, recordLen);
+        m_header->used -= recordLen;
+        --m_header->count;
+
+        if (m_cursorIndex > 0)
+        {
+            --m_cursorIndex;
+        }
+        else
+        {
+            m_cursor = m_header->head;
+        }
+
+        if (m_header->count == 0)
+        {
+            m_header->head = m_header->tail = 0;
+            Rewind();
+        }
+    }
+
+    bool OutboundQueue::OnError(const std::string & error)
+    {
+        m_lastError = error;
+        return false;
+    }
+}
@@ -0,0 +1,97 @@
+#ifndef _IOT_OUTBOUND_QUEUE_H_
+#define _IOT_OUTBOUND_QUEUE_H_
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include <stdint.h>
+#include <string>
+
+namespace iot
+{
+    // Persistent FIFO of messages to be published. The messages are kept in a ring buffer in a memory-mapped file, so
+    // they survive a restart of the process. Messages are read with a cursor, which is moved back to the oldest
+    // message by Rewind, and are removed only when Pop is called for them.
+    class OutboundQueue
+    {
+    public:
+        class Message
+        {
+        public:
+            Message();
+
+            uint64_t seq;
+            std::string topic;
+            std::string payload;
+        };
+
+        OutboundQueue();
+        ~OutboundQueue();
+        bool Open(const std::string& path, size_t maxSize, bool dropOldest);
+        void Close();
+        bool IsOpen() const;
+        const std::string& GetPath() const;
+        bool Push(const std::string& topic, const std::string& payload);
+        bool Peek(Message& message);
+        void Next();
+        void Rewind();
+        void Pop(uint64_t seq);
+        size_t GetLength() const;
+        unsigned long GetDroppedCount() const;
+        const std::string& GetLastError() const;
+
+    private:
+        OutboundQueue(const OutboundQueue& other);
+        OutboundQueue& operator=(const OutboundQueue& other);
+
+        struct Header
+        {
+            char magic[4];
+            uint32_t version;
+            uint64_t capacity;
+            uint64_t head;
+            uint64_t tail;
+            uint64_t used;
+            uint64_t count;
+            uint64_t nextSeq;
+        };
+
+        struct RecordHeader
+        {
+            uint32_t topicLen;
+            uint32_t payloadLen;
+            uint64_t seq;
+        };
+
+        bool OpenFile(const std::string& path, uint64_t& fileSize, Header& header);
+        bool ResizeFile(uint64_t fileSize);
+        bool MapFile(uint64_t fileSize);
+        bool IsValid(const Header& header, uint64_t fileSize) const;
+        void Read(uint64_t offset, void *data, size_t len) const;
+        void Write(uint64_t offset, const void *data, size_t len);
+        uint64_t Advance(uint64_t offset, uint64_t len) const;
+        bool ReadRecord(uint64_t offset, RecordHeader& record);
+        void RemoveHead();
+        bool OnError(const std::string& error);
+
+        std::string m_path;
+        bool m_dropOldest;
+#ifdef _WIN32
+        HANDLE m_file;
+        HANDLE m_mapping;
+#else
+        int m_file;
+#endif
+        void *m_view;
+        size_t m_viewSize;
+        Header *m_header;
+        unsigned char *m_data;
+        // Read cursor and number of messages between the oldest message and the cursor
+        uint64_t m_cursor;
+        uint64_t m_cursorIndex;
+        unsigned long m_droppedCount;
+        std::string m_lastError;
+    };
+}
+
+#endif // _IOT_OUTBOUND_QUEUE_H_
@@ -0,0 +1,1052 @@
+#include <iot/session_manager.h>
+#include "io_owner.h"
+#include "thread.h"
+#include "mpsc_queue.h"
+#include "atomic.h"
+#include "timer.h"
+#include "utils.h"
+#include <fmt/format.h>
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+namespace iot
+{
+    namespace
+    {
+        const int MAX_POLL_EVENTS = 256;
+        // Maximum time for which the worker and the crypto threads wait for events
+        const long WORKER_IDLE_MILLISEC = 1000;
+        // A session may have a posted command, a finished crypto step and a removal request notified at the same time
+        const size_t NOTIFICATIONS_PER_SESSION = 3;
+
+        long long GetTimeMilliseconds()
+        {
+            return GetTimeMicroseconds() / 1000;
+        }
+
+        // Level-triggered readiness notification for many sockets. Uses epoll, so it is available only on Linux.
+        class Poller
+        {
+        public:
+            Poller() : m_fd(-1) {}
+
+            ~Poller()
+            {
+                Close();
+            }
+
+            bool Open()
+            {
+                Close();
+#ifdef __linux__
+                m_fd = epoll_create1(EPOLL_CLOEXEC);
+                if (m_fd < 0)
+                {
+                    return OnError(fmt::sprintf("Failed to create epoll instance: %s", strerror(errno)));
+                }
+                return true;
+#else
+                return OnError("The session manager is not supported on this platform");
+#endif
+            }
+
+            void Close()
+            {
+#ifdef __linux__
+                if (m_fd >= 0)
+                {
+                    close(m_fd);
+                }
+#endif
+                m_fd = -1;
+            }
+
+            // events is a combination of Client::IOEvent flags
+            bool Add(int fd, unsigned int events, void *data)
+            {
+#ifdef __linux__
+                return Control(EPOLL_CTL_ADD, fd, events, data);
+#else
+                return false;
+#endif
+            }
+
+            bool Modify(int fd, unsigned int events, void *data)
+            {
+#ifdef __linux__
+                return Control(EPOLL_CTL_MOD, fd, events, data);
+#else
+                return false;
+#endif
+            }
+
+            void Remove(int fd)
+            {
+#ifdef __linux__
+                // Fails if the socket is already closed, which removes it from the epoll set anyway
+                Control(EPOLL_CTL_DEL, fd, 0, NULL);
+#endif
+            }
+
+            // Returns the number of ready descriptors. Their data is returned by GetData.
+            int Wait(long timeoutMillisec)
+            {
+#ifdef __linux__
+                int count = epoll_wait(m_fd, m_events, MAX_POLL_EVENTS, static_cast<int>(timeoutMillisec));
+                return count > 0 ? count : 0;
+#else
+                Sleep(static_cast<unsigned long>(timeoutMillisec));
+                return 0;
+#endif
+            }
+
+            void *GetData(int index) const
+            {
+#ifdef __linux__
+                return m_events[index].data.ptr;
+#else
+                return NULL;
+#endif
+            }
+
+            const std::string& GetLastError() const
+            {
+                return m_lastError;
+            }
+
+        private:
+            Poller(const Poller& other);
+            Poller& operator=(const Poller& other);
+
+#ifdef __linux__
+            bool Control(int op, int fd, unsigned int events, void *data)
+            {
+                struct epoll_event event;
+                event.events = ((events & Client::IO_READ) != 0 ? EPOLLIN : 0) | ((events & Client::IO_WRITE) != 0 ? EPOLLOUT : 0);
+                event.data.ptr = data;
+                return epoll_ctl(m_fd, op, fd, &event) == 0;
+            }
+
+            struct epoll_event m_events[MAX_POLL_EVENTS];
+#endif
+
+            bool OnError(const std::string& error)
+            {
+                m_lastError = error;
+                return false;
+            }
+
+            int m_fd;
+            std::string m_lastError;
+        };
+    }
+
+    SessionManagerConfig::SessionManagerConfig() : workerThreads(0), cryptoThreads(0), pinWorkerThreads(false), maxSessions(10000) {}
+
+    class SessionManager::Impl
+    {
+    public:
+        Impl() : m_started(false), m_nextId(0) {}
+
+        ~Impl()
+        {
+            Stop();
+        }
+
+        bool Start(const SessionManagerConfig& conf)
+        {
+            if (IsStarted())
+            {
+                return OnError("The session manager is already started");
+            }
+
+            if (conf.maxSessions == 0)
+            {
+                return OnError("Invalid maximum number of sessions");
+            }
+
+            m_conf = conf;
+            unsigned int cpuCount = GetCpuCount();
+            unsigned int cryptoThreads = conf.cryptoThreads > 0 ? conf.cryptoThreads : cpuCount;
+            unsigned int workerThreads = conf.workerThreads > 0 ? conf.workerThreads : cpuCount;
+
+            for (unsigned int i = 0; i < cryptoThreads; ++i)
+            {
+                m_cryptoWorkers.push_back(new CryptoWorker(i));
+                if (!m_cryptoWorkers.back()->Start(conf.maxSessions))
+                {
+                    OnError(m_cryptoWorkers.back()->GetLastError());
+                    Stop();
+                    return false;
+                }
+            }
+
+            for (unsigned int i = 0; i < workerThreads; ++i)
+            {
+                m_workers.push_back(new Worker());
+                if (!m_workers.back()->Start(NOTIFICATIONS_PER_SESSION * conf.maxSessions))
+                {
+                    OnError(m_workers.back()->GetLastError());
+                    Stop();
+                    return false;
+                }
+
+                if (conf.pinWorkerThreads && !m_workers.back()->SetAffinity(i % cpuCount))
+                {
+                    OnError(fmt::sprintf("Failed to bind worker thread %u to CPU %u", i, i % cpuCount));
+                    Stop();
+                    return false;
+                }
+            }
+
+            MutexLock lock(m_mutex);
+            m_started = true;
+            return true;
+        }
+
+        void Stop()
+        {
+            {
+                MutexLock lock(m_mutex);
+                m_started = false;
+            }
+
+            for (size_t i = 0; i < m_cryptoWorkers.size(); ++i)
+            {
+                m_cryptoWorkers[i]->RequestStop();
+            }
+            for (size_t i = 0; i < m_workers.size(); ++i)
+            {
+                m_workers[i]->RequestStop();
+            }
+
+            // A crypto thread finishes the current step first, so it may still notify its worker
+            for (size_t i = 0; i < m_cryptoWorkers.size(); ++i)
+            {
+                m_cryptoWorkers[i]->Join();
+            }
+            for (size_t i = 0; i < m_workers.size(); ++i)
+            {
+                m_workers[i]->Join();
+            }
+
+            // No thread uses the sessions any more, so they are ended from the calling thread
+            MutexLock lock(m_mutex);
+            for (Sessions::iterator s = m_sessions.begin(); s != m_sessions.end(); ++s)
+            {
+                Client& client = *s->first;
+                client.SetIoOwner(NULL);
+                client.ProcessCommands();
+                client.EndSession();
+                delete s->second;
+            }
+            m_sessions.clear();
+
+            for (size_t i = 0; i < m_workers.size(); ++i)
+            {
+                delete m_workers[i];
+            }
+            m_workers.clear();
+
+            for (size_t i = 0; i < m_cryptoWorkers.size(); ++i)
+            {
+                delete m_cryptoWorkers[i];
+            }
+            m_cryptoWorkers.clear();
+        }
+
+        bool IsStarted() const
+        {
+            MutexLock lock(m_mutex);
+            return m_started;
+        }
+
+        bool AddSession(Client& client)
+        {
+            MutexLock lock(m_mutex);
+            if (!m_started)
+            {
+                return OnError("The session manager is not started");
+            }
+
+            if (m_sessions.find(&client) != m_sessions.end())
+            {
+                return OnError("The client is already added to the session manager");
+            }
+
+            if (client.IsSessionStarted())
+            {
+                return OnError("The client has already started a session");
+            }
+
+            if (m_sessions.size() >= m_conf.maxSessions)
+            {
+                return OnError(fmt::sprintf("Maximum number of sessions (%u) reached", m_conf.maxSessions));
+            }
+
+            // Consecutive ids spread the sessions evenly over the workers
+            unsigned long id = m_nextId++;
+            Worker& worker = *m_workers[id % m_workers.size()];
+            Session *session = new Session(*this, client, id, worker);
+            client.SetIoOwner(session);
+
+            Notification notification(Notification::ADD, session);
+            if (!worker.Notify(notification))
+            {
+                client.SetIoOwner(NULL);
+                delete session;
+                return OnError("The session manager queue is full");
+            }
+
+            m_sessions[&client] = session;
+            return true;
+        }
+
+        bool RemoveSession(Client& client)
+        {
+            Session *session;
+            {
+                MutexLock lock(m_mutex);
+                Sessions::iterator s = m_sessions.find(&client);
+                if (s == m_sessions.end())
+                {
+                    return OnError("The client is not added to the session manager");
+                }
+
+                // The session is ended by its worker thread, so waiting for it from a manager thread may dead-lock
+                if (IsManagerThread())
+                {
+                    return OnError("A session can not be removed from an event listener of the session manager");
+                }
+
+                session = s->second;
+                m_sessions.erase(s);
+            }
+
+            Removal *removal = new Removal();
+            Notification notification(Notification::REMOVE, session);
+            notification.removal = removal;
+            while (!session->worker.Notify(notification))
+            {
+                Sleep(1);
+            }
+            removal->Wait();
+            return true;
+        }
+
+        unsigned int GetSessionCount() const
+        {
+            MutexLock lock(m_mutex);
+            return static_cast<unsigned int>(m_sessions.size());
+        }
+
+        const String& GetLastError() const
+        {
+            return m_lastError;
+        }
+
+    private:
+        class Session;
+        class Worker;
+        class Removal;
+        typedef std::multimap<long long, Session *> Deadlines;
+        typedef std::map<Client *, Session *> Sessions;
+
+        class Notification
+        {
+        public:
+            enum Type { ADD, COMMANDS, CRYPTO_STEP, CRYPTO_DONE, REMOVE };
+
+            Notification() : type(ADD), session(NULL), removal(NULL) {}
+            Notification(Type _type, Session *_session) : type(_type), session(_session), removal(NULL) {}
+
+            void Swap(Notification& other)
+            {
+                std::swap(type, other.type);
+                std::swap(session, other.session);
+                std::swap(removal, other.removal);
+            }
+
+            Type type;
+            Session *session;
+            Removal *removal;
+        };
+
+        // The client of a session is used by one thread at a time - its worker, or a crypto thread while the session
+        // is in the crypto pool. The other threads post their commands to the client and notify the worker.
+        class Session : public IoOwner
+        {
+        public:
+            Session(Impl& _manager, Client& _client, unsigned long _id, Worker& _worker)
+                : manager(_manager), client(_client), id(_id), worker(_worker), fd(-1), events(0), hasDeadline(false),
+                inCryptoPool(false), removed(false), removal(NULL), commandsPending(0), cryptoThread(0)
+            {
+            }
+
+            virtual bool IsCurrentThread() const
+            {
+                long index = AtomicLoad(cryptoThread);
+                if (index > 0)
+                {
+                    return manager.m_cryptoWorkers[index - 1]->IsCurrentThread();
+                }
+                return worker.IsProcessing(*this);
+            }
+
+            virtual void OnCommandPosted()
+            {
+                // The worker is notified once for any number of commands, posted before it gets to the session
+                if (AtomicExchange(commandsPending, 1) == 0)
+                {
+                    // The poster may be the worker itself, so it can not wait for room in the queue. If the queue is
+                    // full, the commands are executed when the worker processes the session next time.
+                    Notification notification(Notification::COMMANDS, this);
+                    if (!worker.Notify(notification))
+                    {
+                        AtomicStore(commandsPending, 0);
+                    }
+                }
+            }
+
+            virtual bool MayBlock() const
+            {
+                return AtomicLoad(cryptoThread) > 0;
+            }
+
+            Impl& manager;
+            Client& client;
+            unsigned long id;
+            Worker& worker;
+            // Used only by the worker thread
+            int fd;
+            unsigned int events;
+            bool hasDeadline;
+            Deadlines::iterator deadline;
+            bool inCryptoPool;
+            bool removed;
+            Removal *removal;
+            // Shared between the threads
+            volatile long commandsPending;
+            // Index + 1 of the crypto thread, which runs a step of the session, or 0
+            volatile long cryptoThread;
+        };
+
+        // Shared by the thread, which removes a session, and the worker, so it is deleted by the last one to release it
+        class Removal
+        {
+        public:
+            Removal() : m_done(0), m_references(2)
+            {
+                m_event.Open();
+            }
+
+            // Called by the worker
+            void Complete()
+            {
+                AtomicStore(m_done, 1);
+                if (m_event.IsOpen())
+                {
+                    m_event.Signal();
+                }
+                Release();
+            }
+
+            // Called by the removing thread
+            void Wait()
+            {
+                while (AtomicLoad(m_done) == 0)
+                {
+                    if (m_event.IsOpen())
+                    {
+                        m_event.Wait(-1, static_cast<unsigned long>(WORKER_IDLE_MILLISEC));
+                    }
+                    else
+                    {
+                        Sleep(1);
+                    }
+                }
+                Release();
+            }
+
+        private:
+            void Release()
+            {
+                if (AtomicAdd(m_references, -1) == 1)
+                {
+                    delete this;
+                }
+            }
+
+            WakeupEvent m_event;
+            volatile long m_done;
+            volatile long m_references;
+        };
+
+        // Runs the network I/O of its share of the sessions. Waits for all their sockets at once, and processes only
+        // the sessions, which have received data, have posted commands, or have reached their keepalive or reconnect
+        // deadline, so an idle session costs no CPU time.
+        class Worker : public Runnable
+        {
+        public:
+            Worker() : m_current(NULL), m_stop(0), m_waiting(0) {}
+
+            ~Worker()
+            {
+                Join();
+                for (std::set<Session *>::iterator s = m_removed.begin(); s != m_removed.end(); ++s)
+                {
+                    delete *s;
+                }
+            }
+
+            bool Start(size_t queueSize)
+            {
+                m_notifications.Init(queueSize);
+                if (!m_poller.Open())
+                {
+                    return OnError(m_poller.GetLastError());
+                }
+
+                if (!m_wakeup.Open())
+                {
+                    return OnError(m_wakeup.GetLastError());
+                }
+
+#ifndef _WIN32
+                if (!m_poller.Add(m_wakeup.GetFd(), Client::IO_READ, NULL))
+                {
+                    return OnError("Failed to watch the worker wakeup event");
+                }
+#endif
+
+                if (!m_thread.Start(*this))
+                {
+                    return OnError("Failed to start a worker thread");
+                }
+                return true;
+            }
+
+            void RequestStop()
+            {
+                AtomicStore(m_stop, 1);
+                if (m_wakeup.IsOpen())
+                {
+                    m_wakeup.Signal();
+                }
+            }
+
+            void Join()
+            {
+                m_thread.Join();
+            }
+
+            bool SetAffinity(unsigned int cpu)
+            {
+                return m_thread.SetAffinity(cpu);
+            }
+
+            bool IsCurrentThread() const
+            {
+                return m_thread.IsCurrent();
+            }
+
+            // A callback of one session, which uses another session of the same worker, has to post its commands too
+            bool IsProcessing(const Session& session) const
+            {
+                return m_thread.IsCurrent() && m_current == &session;
+            }
+
+            // Can be called from any thread
+            bool Notify(Notification& notification)
+            {
+                if (!m_notifications.Push(notification))
+                {
+                    return false;
+                }
+
+                if (AtomicExchange(m_waiting, 0) != 0)
+                {
+                    m_wakeup.Signal();
+                }
+                return true;
+            }
+
+            const std::string& GetLastError() const
+            {
+                return m_lastError;
+            }
+
+            virtual void Run()
+            {
+                while (AtomicLoad(m_stop) == 0)
+                {
+                    ProcessNotifications();
+                    ProcessEvents();
+                    ProcessDeadlines();
+                }
+            }
+
+        private:
+            void ProcessNotifications()
+            {
+                for (size_t i = 0; i < m_notifications.GetCapacity() && m_notifications.Pop(m_notification); ++i)
+                {
+                    Session& session = *m_notification.session;
+                    switch (m_notification.type)
+                    {
+                    case Notification::ADD:
+                        DispatchToCryptoPool(session);
+                        break;
+                    case Notification::COMMANDS:
+                        AtomicStore(session.commandsPending, 0);
+                        if (session.removed)
+                        {
+                            // This was the last notification, which refers to the session
+                            m_removed.erase(&session);
+                            delete &session;
+                        }
+                        else if (!session.inCryptoPool)
+                        {
+                            DispatchToCryptoPool(session);
+                        }
+                        break;
+                    case Notification::CRYPTO_DONE:
+                        session.inCryptoPool = false;
+                        if (session.removal != NULL)
+                        {
+                            EndSession(session);
+                        }
+                        else if (session.client.HasCommands())
+                        {
+                            DispatchToCryptoPool(session);
+                        }
+                        else
+                        {
+                            m_current = &session;
+                            Update(session);
+                            m_current = NULL;
+                        }
+                        break;
+                    case Notification::REMOVE:
+                        session.removal = m_notification.removal;
+                        if (!session.inCryptoPool)
+                        {
+                            EndSession(session);
+                        }
+                        break;
+                    default:
+                        break;
+                    }
+                }
+            }
+
+            void ProcessEvents()
+            {
+                long timeout = WORKER_IDLE_MILLISEC;
+                if (!m_deadlines.empty())
+                {
+                    long long left = m_deadlines.begin()->first - GetTimeMilliseconds();
+                    timeout = static_cast<long>(std::max(std::min(left, static_cast<long long>(timeout)), 0LL));
+                }
+
+                AtomicStore(m_waiting, 1);
+                if (!m_notifications.IsEmpty())
+                {
+                    timeout = 0;
+                }
+                int count = m_poller.Wait(timeout);
+                AtomicStore(m_waiting, 0);
+
+                for (int i = 0; i < count; ++i)
+                {
+                    Session *session = static_cast<Session *>(m_poller.GetData(i));
+                    if (session == NULL)
+                    {
+#ifndef _WIN32
+                        m_wakeup.Clear();
+#endif
+                        continue;
+                    }
+                    ProcessIO(*session);
+                }
+            }
+
+            void ProcessDeadlines()
+            {
+                // The expired sessions are collected first, as processing a session may set a new deadline, which
+                // has already expired
+                long long now = GetTimeMilliseconds();
+                m_expired.clear();
+                while (!m_deadlines.empty() && m_deadlines.begin()->first <= now)
+                {
+                    Session *session = m_deadlines.begin()->second;
+                    session->hasDeadline = false;
+                    m_deadlines.erase(m_deadlines.begin());
+                    m_expired.push_back(session);
+                }
+
+                for (std::vector<Session *>::iterator s = m_expired.begin(); s != m_expired.end(); ++s)
+                {
+                    ProcessIO(**s);
+                }
+            }
+
+            void ProcessIO(Session& session)
+            {
+                if (session.inCryptoPool || session.removed)
+                {
+                    return;
+                }
+
+                // Authentication and connecting take several round trips and the authentication computes pairings,
+                // so these steps are passed to the crypto pool, instead of blocking all the sessions of the worker.
+                // So are the commands, as they wait for the acknowledgements from the broker. This also picks up the
+                // commands, whose notification did not fit in the queue.
+                m_current = &session;
+                bool connected = session.client.IsConnected();
+                if ((!connected && session.client.GetIOTimeout() == 0) || session.client.HasCommands())
+                {
+                    m_current = NULL;
+                    DispatchToCryptoPool(session);
+                    return;
+                }
+
+                if (connected)
+                {
+                    session.client.ProcessIO();
+                }
+                Update(session);
+                m_current = NULL;
+            }
+
+            void EndSession(Session& session)
+            {
+                // The commands, posted before the session was ended, are still executed, but not by the worker
+                if (session.client.HasCommands())
+                {
+                    DispatchToCryptoPool(session);
+                    if (session.inCryptoPool)
+                    {
+                        return;
+                    }
+                }
+
+                // The socket is unregistered before it is closed, while its number can not be reused
+                Unregister(session);
+                CancelDeadline(session);
+
+                m_current = &session;
+                session.client.ProcessCommands();
+                session.client.EndSession();
+                session.client.SetIoOwner(NULL);
+                m_current = NULL;
+                // The commands, posted before the owner was released, fail at once, as the session is ended
+                session.client.ProcessCommands();
+
+                session.removed = true;
+                session.removal->Complete();
+                if (AtomicLoad(session.commandsPending) == 0)
+                {
+                    delete &session;
+                }
+                else
+                {
+                    // A COMMANDS notification is still queued
+                    m_removed.insert(&session);
+                }
+            }
+
+            void DispatchToCryptoPool(Session& session)
+            {
+                // The connection may be closed and a new one opened by the crypto thread
+                Unregister(session);
+                CancelDeadline(session);
+                session.inCryptoPool = true;
+                if (!session.manager.DispatchCryptoStep(session))
+                {
+                    session.inCryptoPool = false;
+                    SetDeadline(session, WORKER_IDLE_MILLISEC);
+                }
+            }
+
+            // Brings the registered socket, the events and the deadline of the session up to date
+            void Update(Session& session)
+            {
+                int fd = session.client.GetSocket();
+                unsigned int events = session.client.GetIOEvents();
+                if (fd != session.fd)
+                {
+                    Unregister(session);
+                    if (fd >= 0 && m_poller.Add(fd, events, &session))
+                    {
+                        session.fd = fd;
+                        session.events = events;
+                    }
+                }
+                else if (fd >= 0 && events != session.events && m_poller.Modify(fd, events, &session))
+                {
+                    session.events = events;
+                }
+
+                SetDeadline(session, session.client.GetIOTimeout());
+            }
+
+            void Unregister(Session& session)
+            {
+                if (session.fd >= 0)
+                {
+                    m_poller.Remove(session.fd);
+                    session.fd = -1;
+                    session.events = 0;
+                }
+            }
+
+            void SetDeadline(Session& session, long timeout)
+            {
+                CancelDeadline(session);
+                if (timeout >= 0)
+                {
+                    session.deadline = m_deadlines.insert(std::make_pair(GetTimeMilliseconds() + timeout, &session));
+                    session.hasDeadline = true;
+                }
+            }
+
+            void CancelDeadline(Session& session)
+            {
+                if (session.hasDeadline)
+                {
+                    m_deadlines.erase(session.deadline);
+                    session.hasDeadline = false;
+                }
+            }
+
+            bool OnError(const std::string& error)
+            {
+                m_lastError = error;
+                return false;
+            }
+
+            Thread m_thread;
+            Poller m_poller;
+            WakeupEvent m_wakeup;
+            MpscQueue<Notification> m_notifications;
+            Notification m_notification;
+            Deadlines m_deadlines;
+            std::vector<Session *> m_expired;
+            std::set<Session *> m_removed;
+            const Session *m_current;
+            volatile long m_stop;
+            volatile long m_waiting;
+            std::string m_lastError;
+        };
+
+        // Runs the blocking steps of the sessions - starting a session, authentication and connecting to the broker
+        class CryptoWorker : public Runnable
+        {
+        public:
+            CryptoWorker(unsigned int index) : m_index(index), m_stop(0), m_waiting(0) {}
+
+            ~CryptoWorker()
+            {
+                Join();
+            }
+
+            bool Start(size_t queueSize)
+            {
+                m_steps.Init(queueSize);
+                if (!m_wakeup.Open())
+                {
+                    return OnError(m_wakeup.GetLastError());
+                }
+
+                if (!m_thread.Start(*this))
+                {
+                    return OnError("Failed to start a crypto thread");
+                }
+                return true;
+            }
+
+            void RequestStop()
+            {
+                AtomicStore(m_stop, 1);
+                if (m_wakeup.IsOpen())
+                {
+                    m_wakeup.Signal();
+                }
+            }
+
+            void Join()
+            {
+                m_thread.Join();
+            }
+
+            bool IsCurrentThread() const
+            {
+                return m_thread.IsCurrent();
+            }
+
+            // Called from the worker threads
+            bool Dispatch(Session& session)
+            {
+                Notification step(Notification::CRYPTO_STEP, &session);
+                if (!m_steps.Push(step))
+                {
+                    return false;
+                }
+
+                if (AtomicExchange(m_waiting, 0) != 0)
+                {
+                    m_wakeup.Signal();
+                }
+                return true;
+            }
+
+            const std::string& GetLastError() const
+            {
+                return m_lastError;
+            }
+
+            virtual void Run()
+            {
+                while (AtomicLoad(m_stop) == 0)
+                {
+                    while (AtomicLoad(m_stop) == 0 && m_steps.Pop(m_step))
+                    {
+                        RunStep(*m_step.session);
+                    }
+
+                    AtomicStore(m_waiting, 1);
+                    if (m_steps.IsEmpty() && AtomicLoad(m_stop) == 0)
+                    {
+                        m_wakeup.Wait(-1, static_cast<unsigned long>(WORKER_IDLE_MILLISEC));
+                    }
+                    AtomicStore(m_waiting, 0);
+                }
+            }
+
+        private:
+            void RunStep(Session& session)
+            {
+                AtomicStore(session.cryptoThread, static_cast<long>(m_index) + 1);
+                if (!session.client.IsSessionStarted())
+                {
+                    session.client.StartSession();
+                }
+                else
+                {
+                    session.client.ProcessCommands();
+                    session.client.ProcessIO();
+                }
+                AtomicStore(session.cryptoThread, 0);
+
+                Notification done(Notification::CRYPTO_DONE, &session);
+                session.worker.Notify(done);
+            }
+
+            bool OnError(const std::string& error)
+            {
+                m_lastError = error;
+                return false;
+            }
+
+            unsigned int m_index;
+            Thread m_thread;
+            WakeupEvent m_wakeup;
+            MpscQueue<Notification> m_steps;
+            Notification m_step;
+            volatile long m_stop;
+            volatile long m_waiting;
+            std::string m_lastError;
+        };
+
+        // Sessions are sharded over the crypto threads too, so each of them has its own queue with a single consumer
+        bool DispatchCryptoStep(Session& session)
+        {
+            return m_cryptoWorkers[session.id % m_cryptoWorkers.size()]->Dispatch(session);
+        }
+
+        bool IsManagerThread() const
+        {
+            for (size_t i = 0; i < m_workers.size(); ++i)
+            {
+                if (m_workers[i]->IsCurrentThread())
+                {
+                    return true;
+                }
+            }
+            for (size_t i = 0; i < m_cryptoWorkers.size(); ++i)
+            {
+                if (m_cryptoWorkers[i]->IsCurrentThread())
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool OnError(const String& error)
+        {
+            m_lastError = error;
+            return false;
+        }
+
+        SessionManagerConfig m_conf;
+        std::vector<Worker *> m_workers;
+        std::vector<CryptoWorker *> m_cryptoWorkers;
+        mutable Mutex m_mutex;
+        Sessions m_sessions;
+        bool m_started;
+        unsigned long m_nextId;
+        String m_lastError;
+    };
+
+    SessionManager::SessionManager() : m_impl(new Impl()) {}
+
+    SessionManager::~SessionManager()
+    {
+        delete m_impl;
+    }
+
+    bool SessionManager::Start(const SessionManagerConfig & conf)
+    {
+        return m_impl->Start(conf);
+    }
+
+    void SessionManager::Stop()
+    {
+        m_impl->Stop();
+    }
+
+    bool SessionManager::IsStarted() const
+    {
+        return m_impl->IsStarted();
+    }
+
+    bool SessionManager::AddSession(Client & client)
+    {
+        return m_impl->AddSession(client);
+    }
+
+    bool SessionManager::RemoveSession(Client & client)
+    {
+        return m_impl->RemoveSession(client);
+    }
+
+    unsigned int SessionManager::GetSessionCount() const
+    {
+        return m_impl->GetSessionCount();
+    }
+
+    const String & SessionManager::GetLastError() const
+    {
+        return m_impl->GetLastError();
+    }
+}
@@ -0,0 +1,352 @@
+#ifdef _WIN32
+#include <winsock2.h>
+#endif
+#include "thread.h"
+#include <fmt/format.h>
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sched.h>
+#endif
+#endif
+
+namespace iot
+{
+    namespace
+    {
+        std::string GetSystemError()
+        {
+#ifdef _WIN32
+            return fmt::sprintf("error code %d", ::GetLastError());
+#else
+            return strerror(errno);
+#endif
+        }
+    }
+
+#ifdef _WIN32
+    Thread::Thread() : m_thread(NULL), m_threadId(0) {}
+#else
+    Thread::Thread() : m_thread(), m_started(false) {}
+#endif
+
+    Thread::~Thread()
+    {
+        Join();
+    }
+
+    bool Thread::Start(Runnable & runnable)
+    {
+        if (IsRunning())
+        {
+            return false;
+        }
+
+#ifdef _WIN32
+        m_thread = CreateThread(NULL, 0, ThreadProc, &runnable, 0, &m_threadId);
+        return m_thread != NULL;
+#else
+        m_started = pthread_create(&m_thread, NULL, ThreadProc, &runnable) == 0;
+        return m_started;
+#endif
+    }
+
+    void Thread::Join()
+    {
+        if (!IsRunning())
+        {
+            return;
+        }
+
+#ifdef _WIN32
+        WaitForSingleObject(m_thread, INFINITE);
+        CloseHandle(m_thread);
+        m_thread = NULL;
+#else
+        pthread_join(m_thread, NULL);
+        m_started = false;
+#endif
+    }
+
+    bool Thread::IsRunning() const
+    {
+#ifdef _WIN32
+        return m_thread != NULL;
+#else
+        return m_started;
+#endif
+    }
+
+    bool Thread::IsCurrent() const
+    {
+#ifdef _WIN32
+        return IsRunning() && GetCurrentThreadId() == m_threadId;
+#else
+        return IsRunning() && pthread_equal(pthread_self(), m_thread) != 0;
+#endif
+    }
+
+    bool Thread::SetAffinity(unsigned int cpu)
+    {
+        if (!IsRunning())
+        {
+            return false;
+        }
+
+#ifdef _WIN32
+        if (cpu >= sizeof(DWORD_PTR) * 8)
+        {
+            return false;
+        }
+        return SetThreadAffinityMask(m_thread, static_cast<DWORD_PTR>(1) << cpu) != 0;
+#elif defined(__linux__)
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        return pthread_setaffinity_np(m_thread, sizeof(cpus), &cpus) == 0;
+#else
+        return false;
+#endif
+    }
+
+#ifdef _WIN32
+    DWORD WINAPI Thread::ThreadProc(LPVOID param)
+    {
+        static_cast<Runnable *>(param)->Run();
+        return 0;
+    }
+#else
+    void *Thread::ThreadProc(void *param)
+    {
+        static_cast<Runnable *>(param)->Run();
+        return NULL;
+    }
+#endif
+
+    unsigned int GetCpuCount()
+    {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return std::max(static_cast<unsigned int>(info.dwNumberOfProcessors), 1u);
+#else
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+        return count > 0 ? static_cast<unsigned int>(count) : 1;
+#endif
+    }
+
+#ifdef _WIN32
+    Mutex::Mutex()
+    {
+        InitializeCriticalSection(&m_mutex);
+    }
+
+    Mutex::~Mutex()
+    {
+        DeleteCriticalSection(&m_mutex);
+    }
+
+    void Mutex::Lock()
+    {
+        EnterCriticalSection(&m_mutex);
+    }
+
+    void Mutex::Unlock()
+    {
+        LeaveCriticalSection(&m_mutex);
+    }
+#else
+    Mutex::Mutex()
+    {
+        pthread_mutex_init(&m_mutex, NULL);
+    }
+
+    Mutex::~Mutex()
+    {
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    void Mutex::Lock()
+    {
+        pthread_mutex_lock(&m_mutex);
+    }
+
+    void Mutex::Unlock()
+    {
+        pthread_mutex_unlock(&m_mutex);
+    }
+#endif
+
+#ifdef _WIN32
+    WakeupEvent::WakeupEvent() : m_event(NULL), m_socketEvent(NULL) {}
+#else
+    WakeupEvent::WakeupEvent() : m_readFd(-1), m_writeFd(-1) {}
+#endif
+
+    WakeupEvent::~WakeupEvent()
+    {
+        Close();
+    }
+
+    bool WakeupEvent::Open()
+    {
+        Close();
+#ifdef _WIN32
+        m_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        m_socketEvent = WSACreateEvent();
+        if (m_event == NULL || m_socketEvent == WSA_INVALID_EVENT)
+        {
+            m_socketEvent = NULL;
+            Close();
+            return OnError(fmt::sprintf("Failed to create wakeup event: %s", GetSystemError()));
+        }
+#elif defined(__linux__)
+        m_readFd = m_writeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_readFd < 0)
+        {
+            return OnError(fmt::sprintf("Failed to create wakeup event: %s", GetSystemError()));
+        }
+#else
+        int fds[2];
+        if (pipe(fds) != 0)
+        {
+            return OnError(fmt::sprintf("Failed to create wakeup pipe: %s", GetSystemError()));
+        }
+        m_readFd = fds[0];
+        m_writeFd = fds[1];
+        for (int i = 0; i < 2; ++i)
+        {
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+#endif
+        return true;
+    }
+
+    void WakeupEvent::Close()
+    {
+#ifdef _WIN32
+        if (m_event != NULL)
+        {
+            CloseHandle(m_event);
+            m_event = NULL;
+        }
+        if (m_socketEvent != NULL)
+        {
+            WSACloseEvent(m_socketEvent);
+            m_socketEvent = NULL;
+        }
+#else
+        if (m_writeFd >= 0 && m_writeFd != m_readFd)
+        {
+            close(m_writeFd);
+        }
+        if (m_readFd >= 0)
+        {
+            close(m_readFd);
+        }
+        m_readFd = m_writeFd = -1;
+#endif
+    }
+
+    bool WakeupEvent::IsOpen() const
+    {
+#ifdef _WIN32
+        return m_event != NULL;
+#else
+        return m_readFd >= 0;
+#endif
+    }
+
+    void WakeupEvent::Signal()
+    {
+#ifdef _WIN32
+        SetEvent(m_event);
+#else
+        // Fails only if the event is already signalled (the counter or the pipe is full)
+        uint64_t value = 1;
+        ssize_t res = write(m_writeFd, &value, sizeof(value));
+        (void) res;
+#endif
+    }
+
+    bool WakeupEvent::Wait(int socket, unsigned long timeoutMillisec)
+    {
+#ifdef _WIN32
+        HANDLE events[2] = { m_event, m_socketEvent };
+        DWORD count = 1;
+        SOCKET s = static_cast<SOCKET>(socket);
+        if (socket >= 0 && WSAEventSelect(s, m_socketEvent, FD_READ | FD_CLOSE) == 0)
+        {
+            count = 2;
+        }
+
+        DWORD res = WaitForMultipleObjects(count, events, FALSE, timeoutMillisec < INFINITE ? timeoutMillisec : INFINITE - 1);
+
+        if (count == 2)
+        {
+            // WSAEventSelect switches the socket to non-blocking mode, while mbedtls expects a blocking socket
+            WSAEventSelect(s, NULL, 0);
+            u_long nonBlocking = 0;
+            ioctlsocket(s, FIONBIO, &nonBlocking);
+            WSAResetEvent(m_socketEvent);
+        }
+        return count == 2 && res == WAIT_OBJECT_0 + 1;
+#else
+        struct pollfd fds[2];
+        fds[0].fd = m_readFd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = socket;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        int timeout = timeoutMillisec < static_cast<unsigned long>(INT_MAX) ? static_cast<int>(timeoutMillisec) : INT_MAX;
+        int res = poll(fds, socket >= 0 ? 2 : 1, timeout);
+        if (res <= 0)
+        {
+            return false;
+        }
+
+        if ((fds[0].revents & POLLIN) != 0)
+        {
+            Clear();
+        }
+        return socket >= 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+#endif
+    }
+
+#ifndef _WIN32
+    int WakeupEvent::GetFd() const
+    {
+        return m_readFd;
+    }
+
+    void WakeupEvent::Clear()
+    {
+        uint64_t value;
+        while (read(m_readFd, &value, sizeof(value)) > 0)
+        {
+        }
+    }
+#endif
+
+    const std::string & WakeupEvent::GetLastError() const
+    {
+        return m_lastError;
+    }
+
+    bool WakeupEvent::OnError(const std::string & error)
+    {
+        m_lastError = error;
+        return false;
+    }
+}
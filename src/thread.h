@@ -0,0 +1,130 @@
+#ifndef _IOT_THREAD_H_
+#define _IOT_THREAD_H_
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#include <string>
+
+namespace iot
+{
+    class Runnable
+    {
+    public:
+        virtual ~Runnable() {}
+        virtual void Run() = 0;
+    };
+
+    class Thread
+    {
+    public:
+        Thread();
+        ~Thread();
+        bool Start(Runnable& runnable);
+        void Join();
+        bool IsRunning() const;
+        bool IsCurrent() const;
+        // Binds the running thread to a single CPU
+        bool SetAffinity(unsigned int cpu);
+
+    private:
+        Thread(const Thread& other);
+        Thread& operator=(const Thread& other);
+
+#ifdef _WIN32
+        static DWORD WINAPI ThreadProc(LPVOID param);
+
+        HANDLE m_thread;
+        DWORD m_threadId;
+#else
+        static void *ThreadProc(void *param);
+
+        pthread_t m_thread;
+        bool m_started;
+#endif
+    };
+
+    unsigned int GetCpuCount();
+
+    class Mutex
+    {
+    public:
+        Mutex();
+        ~Mutex();
+        void Lock();
+        void Unlock();
+
+    private:
+        Mutex(const Mutex& other);
+        Mutex& operator=(const Mutex& other);
+
+#ifdef _WIN32
+        CRITICAL_SECTION m_mutex;
+#else
+        pthread_mutex_t m_mutex;
+#endif
+    };
+
+    class MutexLock
+    {
+    public:
+        MutexLock(Mutex& mutex) : m_mutex(mutex)
+        {
+            m_mutex.Lock();
+        }
+
+        ~MutexLock()
+        {
+            m_mutex.Unlock();
+        }
+
+    private:
+        MutexLock(const MutexLock& other);
+        MutexLock& operator=(const MutexLock& other);
+
+        Mutex& m_mutex;
+    };
+
+    // Wakes up a thread, which waits for incoming data on a socket. Uses an eventfd on Linux, a pipe on other POSIX
+    // systems and an event object on Windows.
+    class WakeupEvent
+    {
+    public:
+        WakeupEvent();
+        ~WakeupEvent();
+        bool Open();
+        void Close();
+        bool IsOpen() const;
+        // Can be called from any thread
+        void Signal();
+        // Waits until the event is signalled, the socket (if not negative) becomes readable, or the timeout expires.
+        // Returns true if the socket is readable.
+        bool Wait(int socket, unsigned long timeoutMillisec);
+#ifndef _WIN32
+        // The descriptor becomes readable when the event is signalled, so it can be watched together with other
+        // descriptors. Clear must be called after that.
+        int GetFd() const;
+        void Clear();
+#endif
+        const std::string& GetLastError() const;
+
+    private:
+        WakeupEvent(const WakeupEvent& other);
+        WakeupEvent& operator=(const WakeupEvent& other);
+
+        bool OnError(const std::string& error);
+
+#ifdef _WIN32
+        HANDLE m_event;
+        HANDLE m_socketEvent;
+#else
+        int m_readFd;
+        int m_writeFd;
+#endif
+        std::string m_lastError;
+    };
+}
+
+#endif // _IOT_THREAD_H_
@@ -70,4 +70,18 @@ namespace iot
     {
         return GetLeftMicroseconds() <= 0;
     }
+
+    long long GetTimeMicroseconds()
+    {
+#ifdef _WIN32
+        LARGE_INTEGER frequency, now;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&now);
+        return (now.QuadPart / frequency.QuadPart) * 1000000 + ((now.QuadPart % frequency.QuadPart) * 1000000) / frequency.QuadPart;
+#else
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        return static_cast<long long>(now.tv_sec) * 1000000 + now.tv_usec;
+#endif
+    }
 }
@@ -27,4 +27,7 @@ namespace iot
         struct timeval m_end;
 #endif
     };
+
+    // Current time in microseconds, from the same clock as Timer
+    long long GetTimeMicroseconds();
 }
@@ -0,0 +1,35 @@
+#include <iot/tls_memory_pool.h>
+#include <net/tls_memory_pool.h>
+
+namespace iot
+{
+    TlsMemoryStatistics::TlsMemoryStatistics()
+        : capacity(0), reservedBytes(0), usedBytes(0), usedBytesMax(0), requestedBytes(0), allocations(0),
+        failedAllocations(0)
+    {
+    }
+
+    bool TlsMemoryPool::Enable(unsigned long capacity)
+    {
+        return net::TlsMemoryPool::Enable(static_cast<size_t>(capacity));
+    }
+
+    bool TlsMemoryPool::IsEnabled()
+    {
+        return net::TlsMemoryPool::IsEnabled();
+    }
+
+    TlsMemoryStatistics TlsMemoryPool::GetStatistics()
+    {
+        net::TlsMemoryStats stats = net::TlsMemoryPool::GetStats();
+        TlsMemoryStatistics result;
+        result.capacity = static_cast<unsigned long>(stats.capacity);
+        result.reservedBytes = static_cast<unsigned long>(stats.reservedBytes);
+        result.usedBytes = static_cast<unsigned long>(stats.usedBytes);
+        result.usedBytesMax = static_cast<unsigned long>(stats.usedBytesMax);
+        result.requestedBytes = static_cast<unsigned long>(stats.requestedBytes);
+        result.allocations = stats.allocations;
+        result.failedAllocations = stats.failedAllocations;
+        return result;
+    }
+}
@@ -0,0 +1,189 @@
+#include "topic_trie.h"
+
+namespace iot
+{
+    namespace
+    {
+        const char LEVEL_SEPARATOR = '/';
+        const char SINGLE_LEVEL_WILDCARD[] = "+";
+        const char MULTI_LEVEL_WILDCARD[] = "#";
+
+        size_t GetLevelEnd(const std::string& topicFilter, size_t levelPos)
+        {
+            size_t levelEnd = topicFilter.find(LEVEL_SEPARATOR, levelPos);
+            return levelEnd == std::string::npos ? topicFilter.length() : levelEnd;
+        }
+    }
+
+    TopicTrie::Node::Node() : handler(NULL), multiLevelHandler(NULL) {}
+
+    TopicTrie::Node::~Node()
+    {
+        for (Children::iterator c = children.begin(); c != children.end(); ++c)
+        {
+            delete c->second;
+        }
+    }
+
+    bool TopicTrie::Node::IsEmpty() const
+    {
+        return children.empty() && handler == NULL && multiLevelHandler == NULL;
+    }
+
+    TopicTrie::TopicTrie() : m_root(new Node()) {}
+
+    TopicTrie::~TopicTrie()
+    {
+        delete m_root;
+    }
+
+    void TopicTrie::Insert(const std::string & topicFilter, MessageHandler * handler)
+    {
+        Node *node = m_root;
+        size_t levelPos = 0;
+        while (true)
+        {
+            size_t levelEnd = GetLevelEnd(topicFilter, levelPos);
+            std::string level = topicFilter.substr(levelPos, levelEnd - levelPos);
+            if (level == MULTI_LEVEL_WILDCARD)
+            {
+                node->multiLevelHandler = handler;
+                return;
+            }
+
+            Node *&child = node->children[level];
+            if (child == NULL)
+            {
+                child = new Node();
+            }
+            node = child;
+
+            if (levelEnd == topicFilter.length())
+            {
+                node->handler = handler;
+                return;
+            }
+            levelPos = levelEnd + 1;
+        }
+    }
+
+    bool TopicTrie::Remove(const std::string & topicFilter)
+    {
+        return Remove(m_root, topicFilter, 0);
+    }
+
+    bool TopicTrie::Remove(Node * node, const std::string & topicFilter, size_t levelPos)
+    {
+        size_t levelEnd = GetLevelEnd(topicFilter, levelPos);
+        std::string level = topicFilter.substr(levelPos, levelEnd - levelPos);
+        if (level == MULTI_LEVEL_WILDCARD)
+        {
+            bool removed = node->multiLevelHandler != NULL;
+            node->multiLevelHandler = NULL;
+            return removed;
+        }
+
+        Node::Children::iterator child = node->children.find(level);
+        if (child == node->children.end())
+        {
+            return false;
+        }
+
+        bool removed = false;
+        if (levelEnd == topicFilter.length())
+        {
+            removed = child->second->handler != NULL;
+            child->second->handler = NULL;
+        }
+        else
+        {
+            removed = Remove(child->second, topicFilter, levelEnd + 1);
+        }
+
+        if (child->second->IsEmpty())
+        {
+            delete child->second;
+            node->children.erase(child);
+        }
+        return removed;
+    }
+
+    void TopicTrie::Clear()
+    {
+        delete m_root;
+        m_root = new Node();
+    }
+
+    bool TopicTrie::IsEmpty() const
+    {
+        return m_root->IsEmpty();
+    }
+
+    void TopicTrie::Match(const char * topic, size_t topicLen, Handlers & handlers) const
+    {
+        Match(m_root, topic, topic + topicLen, true, handlers);
+    }
+
+    void TopicTrie::Match(const Node * node, const char * level, const char * end, bool firstLevel, Handlers & handlers)
+    {
+        // Topics starting with '$' are not matched by a wildcard at the first level
+        bool wildcardsAllowed = !(firstLevel && level != end && *level == '$');
+
+        if (node->multiLevelHandler != NULL && wildcardsAllowed)
+        {
+            handlers.push_back(node->multiLevelHandler);
+        }
+
+        if (node->children.empty())
+        {
+            return;
+        }
+
+        const char *levelEnd = level;
+        while (levelEnd != end && *levelEnd != LEVEL_SEPARATOR)
+        {
+            ++levelEnd;
+        }
+        bool lastLevel = (levelEnd == end);
+
+        const Node *matched[2] = { NULL, NULL };
+        Node::Children::const_iterator child = node->children.find(std::string(level, levelEnd));
+        if (child != node->children.end())
+        {
+            matched[0] = child->second;
+        }
+        if (wildcardsAllowed)
+        {
+            child = node->children.find(SINGLE_LEVEL_WILDCARD);
+            if (child != node->children.end())
+            {
+                matched[1] = child->second;
+            }
+        }
+
+        for (int i = 0; i < 2; ++i)
+        {
+            if (matched[i] == NULL)
+            {
+                continue;
+            }
+
+            if (lastLevel)
+            {
+                // "a/#" matches "a" as well
+                if (matched[i]->handler != NULL)
+                {
+                    handlers.push_back(matched[i]->handler);
+                }
+                if (matched[i]->multiLevelHandler != NULL)
+                {
+                    handlers.push_back(matched[i]->multiLevelHandler);
+                }
+            }
+            else
+            {
+                Match(matched[i], levelEnd + 1, end, false, handlers);
+            }
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef _IOT_TOPIC_TRIE_H_
+#define _IOT_TOPIC_TRIE_H_
+
+#include <string>
+#include <vector>
+#include <map>
+
+namespace iot
+{
+    class MessageHandler;
+
+    // Maps MQTT topic filters (with '+' and '#' wildcards) to message handlers. A topic is matched level by level,
+    // so the cost depends on the topic depth and not on the number of filters.
+    class TopicTrie
+    {
+    public:
+        typedef std::vector<MessageHandler *> Handlers;
+
+        TopicTrie();
+        ~TopicTrie();
+        void Insert(const std::string& topicFilter, MessageHandler *handler);
+        bool Remove(const std::string& topicFilter);
+        void Clear();
+        bool IsEmpty() const;
+        void Match(const char *topic, size_t topicLen, Handlers& handlers) const;
+
+    private:
+        TopicTrie(const TopicTrie& other);
+        TopicTrie& operator=(const TopicTrie& other);
+
+        class Node
+        {
+        public:
+            typedef std::map<std::string, Node *> Children;
+
+            Node();
+            ~Node();
+            bool IsEmpty() const;
+
+            Children children;
+            MessageHandler *handler;
+            MessageHandler *multiLevelHandler;
+        };
+
+        static bool Remove(Node *node, const std::string& topicFilter, size_t levelPos);
+        static void Match(const Node *node, const char *level, const char *end, bool firstLevel, Handlers& handlers);
+
+        Node *m_root;
+    };
+}
+
+#endif // _IOT_TOPIC_TRIE_H_
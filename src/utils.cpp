@@ -1,5 +1,6 @@
 #include "utils.h"
 #include "exception.h"
+#include "thread.h"
 #include <stdint.h>
 
 namespace iot
@@ -7,6 +8,48 @@ namespace iot
     namespace
     {
         const char* hexChars = "0123456789abcdef";
+
+        // The TLS context with the default CA store, shared by the HTTPS connections of all clients in the process.
+        // It is created with the first client and released with the last one.
+        class HttpsContext
+        {
+        public:
+            static net::TlsContext& Acquire()
+            {
+                MutexLock lock(s_mutex);
+                if (s_instance == NULL)
+                {
+                    s_instance = new HttpsContext();
+                }
+                ++s_instance->m_refCount;
+                return s_instance->m_context;
+            }
+
+            static void Release()
+            {
+                MutexLock lock(s_mutex);
+                if (s_instance != NULL && --s_instance->m_refCount == 0)
+                {
+                    delete s_instance;
+                    s_instance = NULL;
+                }
+            }
+
+        private:
+            HttpsContext() : m_refCount(0)
+            {
+                m_context.SetX509CaStore(net::x509::CaStore::GetDefault());
+            }
+
+            net::TlsContext m_context;
+            unsigned int m_refCount;
+
+            static Mutex s_mutex;
+            static HttpsContext *s_instance;
+        };
+
+        Mutex HttpsContext::s_mutex;
+        HttpsContext *HttpsContext::s_instance = NULL;
     }
 
     std::string HexEncode(const std::string & data)
@@ -81,11 +124,18 @@ namespace iot
 
     JsonHttpClient::JsonHttpClient() : m_client(m_network)
     {
-        m_caChain.LoadDefaultData();
-        m_network.SetX509CaChain(m_caChain);
+        m_network.SetTlsContext(HttpsContext::Acquire());
         m_client.SetTimeout(10000);
     }
 
+    JsonHttpClient::~JsonHttpClient()
+    {
+        // No connection may use the shared context after it is released
+        m_network.Close();
+        m_network.SetMaxIdleConnections(0);
+        HttpsContext::Release();
+    }
+
     json::Object JsonHttpClient::MakeRequest(net::http::Method method, const std::string & url, const json::Object & data)
     {
         net::http::Request request(method, url);
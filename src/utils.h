@@ -24,6 +24,7 @@ namespace iot
     {
     public:
         JsonHttpClient();
+        ~JsonHttpClient();
         json::Object MakePostRequest(const std::string& url, const json::Object& data);
         json::Object MakeGetRequest(const std::string& url);
 
@@ -32,7 +33,6 @@ namespace iot
 
         net::http::Client m_client;
         net::http::NetworkImpl m_network;
-        net::x509::CaChain m_caChain;
     };
 
     void Sleep(unsigned long milliSeconds);
@@ -17,6 +17,10 @@ namespace
     const char MQTT_COMMAND_TIMEOUT[] = "mqttCommandTimeout";
     const char USE_MQTT_QOS2[] = "useMqttQoS2";
     const char USE_MQTT_PERSISTENT_SESSION[] = "useMqttPersistentSession";
+    const char MQTT_PUBLISH_WINDOW[] = "mqttPublishWindow";
+    const char PSK_LIFETIME[] = "pskLifetimeSec";
+    const char OUTBOUND_QUEUE_FILE[] = "outboundQueueFile";
+    const char USE_IO_THREAD[] = "useIoThread";
     const char AWS_IOT_COMPLIANCE[] = "awsIoTCompliance";
     const char SUBSCRIBE_TO_TOPIC[] = "subscribeToTopic";
     const char PUBLISH_TO_TOPIC[] = "publishToTopic";
@@ -32,6 +36,10 @@ namespace
         { MQTT_COMMAND_TIMEOUT, "MQTT command timeout in milliseconds", "10000" },
         { USE_MQTT_QOS2, "If true, MQTT publish/subscribe will be made with QoS2, else with QoS1", "false" },
         { USE_MQTT_PERSISTENT_SESSION, "If true, persistent MQTT session will be requested when connecting", "true" },
+        { MQTT_PUBLISH_WINDOW, "Max number of unacknowledged asynchronous publishes (0 - publish synchronously)", "0" },
+        { PSK_LIFETIME, "Time in seconds to reuse the authentication PSK on reconnect (0 - always authenticate)", "3600" },
+        { OUTBOUND_QUEUE_FILE, "File to keep the outgoing messages in until they are acknowledged (empty - no queue)", "" },
+        { USE_IO_THREAD, "If true, the connection is run by an internal I/O thread and the commands are queued to it", "false" },
         { AWS_IOT_COMPLIANCE, "Force useMqttQoS2=false and useMqttPersistentSession=false if true", "false" },
         { SUBSCRIBE_TO_TOPIC, "MQTT topic name to subscribe and continuously listen to, if specified", "" },
         { PUBLISH_TO_TOPIC, "MQTT topic name to publish a message to, if specified", "" },
@@ -73,6 +81,10 @@ namespace
             mqttCommandTimeoutMillisec = atoi(flags.Get(MQTT_COMMAND_TIMEOUT).c_str());
             useMqttQoS2 = flags.GetBoolean(USE_MQTT_QOS2);
             useMqttPersistentSession = flags.GetBoolean(USE_MQTT_PERSISTENT_SESSION);
+            mqttPublishWindow = atoi(flags.Get(MQTT_PUBLISH_WINDOW).c_str());
+            pskLifetimeSec = atoi(flags.Get(PSK_LIFETIME).c_str());
+            outboundQueueFile = flags.Get(OUTBOUND_QUEUE_FILE);
+            useIoThread = flags.GetBoolean(USE_IO_THREAD);
             if (flags.GetBoolean(AWS_IOT_COMPLIANCE))
             {
                 cout << "Forcing AWS IoT compliance" << endl;
@@ -126,6 +138,10 @@ namespace
             {
                 json["sokRecvKey"] = json::String(identity.GetSokRecvKeyHex());
             }
+            if (!identity.precomputeData.empty())
+            {
+                json["precomputeData"] = json::String(identity.GetPrecomputeDataHex());
+            }
 
             file << json;
 
@@ -142,6 +158,7 @@ namespace
                 id.dtaList.push_back((const json::String&) *i);
             }
             id.SetSokKeys(GetOptionalString(json, "sokSendKey"), GetOptionalString(json, "sokRecvKey"));
+            id.SetPrecomputeData(GetOptionalString(json, "precomputeData"));
             return id;
         }
 
@@ -210,6 +227,11 @@ namespace
             cout << " - Incomming private message (from " << userIdFrom << "): '" << payload << "'" << endl;
         }
 
+        virtual void OnPublishCompleted(unsigned short packetId, bool ok)
+        {
+            cout << " - Publish " << packetId << (ok ? " acknowledged" : " failed") << endl;
+        }
+
     private:
         Config& m_conf;
     };
@@ -0,0 +1,125 @@
+#include <mbedtls/x509_crt.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+
+using std::cout;
+using std::endl;
+using std::string;
+
+namespace
+{
+    unsigned char CACERT_DATA[] = {
+        #include "cacert.inc"
+    };
+
+    class Certificate
+    {
+    public:
+        Certificate(const mbedtls_x509_crt& crt) :
+            der(reinterpret_cast<const char *>(crt.raw.p), crt.raw.len),
+            subjectOffset(crt.subject_raw.p - crt.raw.p),
+            subjectLen(crt.subject_raw.len)
+        {
+        }
+
+        string GetSubject() const
+        {
+            return der.substr(subjectOffset, subjectLen);
+        }
+
+        bool operator<(const Certificate& other) const
+        {
+            string subject = GetSubject();
+            string otherSubject = other.GetSubject();
+            return subject != otherSubject ? subject < otherSubject : der < other.der;
+        }
+
+        bool operator==(const Certificate& other) const
+        {
+            return der == other.der;
+        }
+
+        string der;
+        size_t subjectOffset;
+        size_t subjectLen;
+    };
+
+    void WriteBytes(std::ostream& out, const string& data)
+    {
+        for (size_t i = 0; i < data.length(); ++i)
+        {
+            char hex[8];
+            sprintf(hex, "0x%02x", static_cast<unsigned char>(data[i]));
+            out << (i % 12 == 0 ? "  " : " ") << hex << ",";
+            if (i % 12 == 11 || i + 1 == data.length())
+            {
+                out << "\n";
+            }
+        }
+    }
+}
+
+// Converts a PEM CA bundle to the DER certificates, sorted by subject name, and their index, as included by
+// lib/netlib/src/x509.cpp. Without an input file, the bundle from lib/netlib/src/cacert.inc is converted.
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        cout << "Usage:" << endl;
+        cout << "   cacert_der <output_file> [<pem_bundle_file>]" << endl;
+        return 0;
+    }
+
+    mbedtls_x509_crt chain;
+    mbedtls_x509_crt_init(&chain);
+    int res = argc > 2 ?
+        mbedtls_x509_crt_parse_file(&chain, argv[2]) :
+        mbedtls_x509_crt_parse(&chain, CACERT_DATA, sizeof(CACERT_DATA));
+    if (res != 0)
+    {
+        cout << "Failed to parse the CA bundle: " << res << endl;
+        mbedtls_x509_crt_free(&chain);
+        return -1;
+    }
+
+    std::vector<Certificate> certificates;
+    for (mbedtls_x509_crt *crt = &chain; crt != NULL && crt->raw.p != NULL; crt = crt->next)
+    {
+        certificates.push_back(Certificate(*crt));
+    }
+    mbedtls_x509_crt_free(&chain);
+
+    std::sort(certificates.begin(), certificates.end());
+    certificates.erase(std::unique(certificates.begin(), certificates.end()), certificates.end());
+
+    std::ofstream out(argv[1]);
+    if (!out)
+    {
+        cout << "Failed to open " << argv[1] << endl;
+        return -1;
+    }
+
+    out << "// Generated by tools/cacert_der - do not edit\n";
+    out << "const unsigned char CACERT_DER_DATA[] = {\n";
+    for (std::vector<Certificate>::const_iterator i = certificates.begin(); i != certificates.end(); ++i)
+    {
+        WriteBytes(out, i->der);
+    }
+    out << "};\n\n";
+
+    out << "const CaStore::Entry CACERT_DER_INDEX[] = {\n";
+    size_t offset = 0;
+    for (std::vector<Certificate>::const_iterator i = certificates.begin(); i != certificates.end(); ++i)
+    {
+        out << "  { " << offset << ", " << i->der.length() << ", " << offset + i->subjectOffset << ", " << i->subjectLen << " },\n";
+        offset += i->der.length();
+    }
+    out << "};\n";
+
+    cout << certificates.size() << " certificates, " << offset << " bytes" << endl;
+    return 0;
+}